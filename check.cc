@@ -0,0 +1,174 @@
+// Cross-checks the searches of la-tripods.cc against brute force on small random instances.
+//
+// Run: make check
+
+#define LA_TRIPODS_NO_MAIN
+#include "la-tripods.cc"
+
+namespace {
+
+bool Same(const Score& a, const Score& b) { return !a.BetterThan(b) && !b.BetterThan(a); }
+
+// The best score over all sets of items that fit into `book`.
+Score BruteForce(const Instance& instance, const Book& book) {
+  Score best;
+  for (uint32_t m = 0; m != 1u << instance.size(); ++m) {
+    Book left = book;
+    Score s;
+    bool fits = true;
+    for (uint32_t j = 0; j != instance.size() && fits; ++j) {
+      if (!(m >> j & 1)) continue;
+      fits = left[instance.rows[j]]-- > 0;
+      instance.Add(s, j);
+    }
+    if (fits && s.BetterThan(best)) best = s;
+  }
+  return best;
+}
+
+// A random instance with up to 12 items, 8 tripods, 2 classes and 3 rows.
+struct Random {
+  explicit Random(uint32_t seed) : rng(seed) {
+    tripods = Uniform(3, 8);
+    classes.resize(Uniform(1, 2));
+    for (Class& cls : classes) {
+      for (int t = 1; t <= tripods; ++t) cls.tripods.push_back(t);
+      shuffle(cls.tripods.begin(), cls.tripods.end(), rng);
+      cls.tripods.resize(Uniform(2, tripods));
+      for (int k = Uniform(0, 2), left = cls.tripods.size(); k-- && left;) {
+        left -= cls.tiers.emplace_back(Uniform(0, left));
+      }
+      if (!Uniform(0, 2)) cls.weights.push_back({cls.tripods[0], Uniform(1, 3)});
+      cls.weight = Uniform(1, 2);
+    }
+    rows = Uniform(1, 3);
+    for (int r = 0; r != rows; ++r) book[r] = Uniform(1, 3);
+    for (int i = Uniform(5, 12); i--;) items.push_back(Candidate());
+    if (Uniform(0, 1)) {
+      Book left = book;
+      for (uint32_t i = 0; i != items.size(); ++i) {
+        if (!Uniform(0, 3) && left[items[i].row]) {
+          placed.push_back(i);
+          --left[items[i].row];
+        }
+      }
+    }
+  }
+
+  int Uniform(int a, int b) { return uniform_int_distribution(a, b)(rng); }
+
+  Item Candidate() {
+    uint8_t t[kTripods] = {}, l[kTripods] = {};
+    for (int j = Uniform(0, 2); j--;) {
+      t[j] = Uniform(1, tripods);
+      l[j] = Uniform(0, 2) ? 1 : Uniform(1, 3);
+    }
+    uint16_t cost = Uniform(0, 2) ? 0 : Uniform(1, 3);
+    return {uint8_t(Uniform(0, rows - 1)), cost, {t[0], t[1], t[2]}, {l[0], l[1], l[2]}};
+  }
+
+  mt19937 rng;
+  int tripods, rows;
+  vector<Class> classes;
+  Book book = {};
+  vector<Item> items;
+  vector<uint32_t> placed;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int instances = argc > 1 ? atoi(argv[1]) : 300;
+  map<string, int> failures;
+  int checked = 0;
+  for (int seed = 0; seed != instances; ++seed) {
+    Random r(seed);
+    Instance instance(r.items, r.classes, r.book, r.placed);
+    const Score want = BruteForce(instance, r.book);
+    // The searches only prove a solution optimal if it has every tripod of the top tiers.
+    if (!instance.HasAllPrio(want)) continue;
+    ++checked;
+    auto check = [&](const string& name, bool ok) {
+      if (!ok && !failures[name]++) cerr << name << " fails on seed " << seed << endl;
+    };
+    auto expect = [&](const string& name, const Score& s) { check(name, Same(s, want)); };
+
+    expect("Optimize", Optimize(instance, {}, {}, nullptr).score);
+    for (auto [name, setup] : initializer_list<pair<string, void (*)(Instance&)>>{
+             {"Lagrangian and LP",
+              [](Instance& i) {
+                i.lagrangian = true;
+                i.lp_depth = 100;
+              }},
+             {"No bounds",
+              [](Instance& i) {
+                i.top_gains = false;
+                i.lp_depth = -1;
+              }},
+             {"Fewest candidates first", [](Instance& i) { i.SortTripodsByCandidates(); }},
+             {"Cheapest first", [](Instance& i) { i.SortCandidatesByCost(); }},
+         }) {
+      Instance local = instance;
+      setup(local);
+      expect(name, Optimize(local, {}, {}, nullptr).score);
+    }
+    expect("OptimizeParts", OptimizeParts(instance, r.items, nullptr).score);
+    expect("OptimizeInEpochs", OptimizeInEpochs(instance, 2, nullptr).score);
+    expect("OptimizeBestFirst", OptimizeBestFirst(instance, 1 << 20, nullptr).score);
+    expect("OptimizeBestFirst, tiny frontier", OptimizeBestFirst(instance, 1, nullptr).score);
+    expect("OptimizeWithDiscrepancies", OptimizeWithDiscrepancies(instance, 1, nullptr).score);
+    expect("OptimizeWithRestarts", OptimizeWithRestarts(instance, 3, nullptr).score);
+    expect("OptimizePortfolio", OptimizePortfolio(instance, nullptr).score);
+    check("BeamSearch", !BeamSearch(instance, 4, nullptr).score.BetterThan(want));
+
+    vector<Solution> top = Top(instance, 3);
+    check("Top", !top.empty() && Same(top[0].score, want));
+    for (size_t i = 1; i < top.size(); ++i) {
+      check("Top", !top[i].score.BetterThan(top[i - 1].score));
+      for (size_t j = 0; j != i; ++j) check("Top, distinct", top[i].items != top[j].items);
+    }
+
+    // A stopped search bounds the rest of it.
+    for (uint64_t stop = 1;; stop += 5) {
+      Search search(instance, instance.book, {});
+      Solution best;
+      bool done = search.Run([&](const Score& s, bool leaf) {
+        if (search.nodes == stop) search.Pause();
+        if (s.BetterThan(best.score)) best = {s, search.Used()};
+        return !leaf && instance.MayImprove(s, search.book, best.score);
+      });
+      if (done) break;
+      Score bound = search.Bound(best.score);
+      bool ok = true;
+      for (uint8_t k = 0; k != instance.tiers; ++k) ok = ok && bound.tiers[k] >= want.tiers[k];
+      check("Search::Bound", ok);
+    }
+
+    const string path = "check.instance";
+    instance.Save(path, r.items);
+    vector<Item> loaded_items;
+    expect("Instance::Load", Optimize(Instance::Load(path, loaded_items), {}, {}, nullptr).score);
+    remove(path.c_str());
+
+    const vector<Solution> curve = Sweep(instance, 2);
+    for (uint8_t e = 0; e != curve.size(); ++e) {
+      Book book = r.book;
+      for (uint8_t& slots : book) slots += e;
+      Instance larger(r.items, r.classes, book, r.placed);
+      Score s = BruteForce(larger, book);
+      if (larger.HasAllPrio(s)) check("Sweep", Same(curve[e].score, s));
+    }
+
+    Item candidate = r.Candidate();
+    vector<Item> more = r.items;
+    more.push_back(candidate);
+    Instance with(more, r.classes, r.book, r.placed);
+    Score s = BruteForce(with, r.book);
+    Solution base = Optimize(instance, {}, {}, nullptr);
+    if (with.HasAllPrio(s)) check("WhatIf", Same(WhatIf(instance, base, {candidate})[0].score, s));
+  }
+  cout << "Checked " << checked << " instances";
+  for (auto [name, n] : failures) cout << ", " << name << " failed on " << n;
+  cout << endl;
+  return !failures.empty();
+}
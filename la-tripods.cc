@@ -3,143 +3,3452 @@
 // 1. Edit Main():
 //    - Specify how many empty slots of each kind you have in the tripod library.
 //    - List tripods for your class, with high-priority ones at the top.
-//    - Set prio_tripods to the number of high-priority tripods.
+//    - Set tiers to the number of high-priority tripods. For finer control, split tripods
+//      into more tiers and give some of them weights.
+//    - Optionally, list several classes in roster to optimize the library for all of them.
 //    - List all items with tripods that you have or can buy.
+//    - Optionally, describe what's in the library now to get the moves that rearrange it.
+//    - Optionally, list candidate items that you consider buying to see how much
+//      each of them would improve the score.
 // 2. Run: make && ./la-tripods
 //
+// To consider items from the market, dump the listings into a file (see ReadMarket() for the
+// format) and run: ./la-tripods --market=listings.txt
+//
+// To see how much more slots in the library would give you, run: ./la-tripods --sweep=3
+//
+// To keep the solver running and answer requests on a Unix socket (see Serve()), run:
+// ./la-tripods --serve=/tmp/la-tripods.sock
+//
+// To skip building the instance on every run, save it once with --save_instance=FILE and pass
+// --instance=FILE to later runs.
+//
 // The output will tell you which items to store in the library so that the
 // following properties are optimized in this order:
 //
 // 1. The number of stored high-priority tripods (max).
 // 2. The number of stored low-priority tripods (max).
 // 3. The total cost of bought items (min).
+// 4. The number of items to put into the library or take out of it (min), if you described
+//    what's in the library now.
+//
+// With more tiers, every tier is compared in order before the cost. Tripods with weights and
+// tripods of classes with weights count as many times as their weights. If items have tripod
+// levels, every tripod counts as many times as the highest level of it that is stored.
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <compare>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using namespace std;
+
+// Each page has this many rows: helmet, shoulders, etc.
+constexpr uint8_t kRows = 6;
+// Each item can have up to this many tripods.
+constexpr uint8_t kTripods = 3;
+
+using Book = array<uint8_t, kRows>;
+
+// Trims whitespace on both ends.
+string_view Trim(string_view s) {
+  while (!s.empty() && isspace(s.front())) s.remove_prefix(1);
+  while (!s.empty() && isspace(s.back())) s.remove_suffix(1);
+  return s;
+}
+
+// The 64-bit FNV-1a hash of the bytes.
+uint64_t Fnv1a(string_view bytes) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (char c : bytes) h = (h ^ uint8_t(c)) * 0x100000001b3;
+  return h;
+}
+
+// Parses the stringified body of an enum: "kFoo = 1, kBar, ...". The result maps values to
+// names without the leading 'k': res[1] == "Foo", res[2] == "Bar".
+vector<string> EnumNames(string_view s) {
+  vector<string> res;
+  size_t value = 0;
+  while (!s.empty()) {
+    size_t comma = min(s.find(','), s.size());
+    string_view name = Trim(s.substr(0, comma));
+    s.remove_prefix(min(comma + 1, s.size()));
+    if (name.empty()) continue;
+    if (size_t eq = name.find('='); eq != string_view::npos) {
+      value = stoul(string(name.substr(eq + 1)));
+      name = Trim(name.substr(0, eq));
+    }
+    if (name.front() == 'k') name.remove_prefix(1);
+    if (res.size() <= value) res.resize(value + 1);
+    res[value++] = name;
+  }
+  return res;
+}
+
+// Defines enum `type` and a vector of its names called `names`. See EnumNames().
+#define NAMED_ENUM(type, names, ...) \
+  enum type { __VA_ARGS__ };         \
+  const vector<string> names = EnumNames(#__VA_ARGS__)
+
+struct Item {
+  // The row this item goes to (helmet, shoulders, etc.). In [0, kRows).
+  const uint8_t row;
+  // How much gold it costs to use this item.
+  const uint16_t cost;
+  // Tripods that this item provides.
+  const uint8_t tripods[kTripods];
+  // Levels of the tripods, in [1, kMaxLevel]. Zero means level 1.
+  const uint8_t levels[kTripods] = {};
+};
+
+// A class whose tripods should be stored in the library. Several classes can share one library.
+struct Class {
+  // Tripods of the class, the most important first. At most 64.
+  vector<uint8_t> tripods;
+  // Tripods are split into priority tiers: the first tiers[0] tripods form the top tier, the
+  // next tiers[1] tripods form the second one and so on. The remaining tripods form the last
+  // tier. For example, {20} makes the first 20 tripods high-priority and the rest low-priority.
+  vector<uint8_t> tiers;
+  // Tripods that count more than once within their tier, with their weights. Other tripods have
+  // weight 1. Weights are positive: the bounds of the search assume that tripods never hurt.
+  vector<pair<uint8_t, int>> weights;
+  // Every tripod of this class counts this many times in the score. Positive too.
+  int weight = 1;
+};
+
+// At most this many classes can share the library.
+constexpr uint8_t kMaxClasses = 8;
+// At most this many priority tiers, including the last one.
+constexpr uint8_t kMaxTiers = 8;
+// Tripod levels are in [1, kMaxLevel].
+constexpr uint8_t kMaxLevel = 7;
+
+// Levels of tripods are packed into 4-bit lanes, 16 lanes per word, so that they can be updated
+// and compared a word at a time. Every class takes 4 words: lane i of the class is the level of
+// its tripod i, zero if the tripod isn't stored. Lanes never exceed kMaxLevel, so the top bit of
+// every lane is always clear.
+constexpr uint8_t kClassWords = 4;
+using Levels = array<uint64_t, kMaxClasses * kClassWords>;
+
+// The lowest bit of every lane.
+constexpr uint64_t kLanes = 0x1111111111111111;
+
+// The maximum of a and b in every lane.
+uint64_t LaneMax(uint64_t a, uint64_t b) {
+  // Lanes of a | 8 can't borrow, and their top bit survives subtraction iff a >= b.
+  uint64_t ge = ((((a | kLanes * 8) - b) >> 3) & kLanes) * 15;
+  return (a & ge) | (b & ~ge);
+}
+
+// The lowest bit of every non-zero lane.
+uint64_t NonZeroLanes(uint64_t x) { return (x | x >> 1 | x >> 2 | x >> 3) & kLanes; }
+
+// The sum of all lanes.
+int LaneSum(uint64_t x) {
+  x = (x & 0x0F0F0F0F0F0F0F0F) + ((x >> 4) & 0x0F0F0F0F0F0F0F0F);
+  return (x * 0x0101010101010101) >> 56;
+}
+
+// Lane i of class c.
+uint8_t Lane(const Levels& v, uint8_t c, uint8_t i) {
+  return v[c * kClassWords + i / 16] >> (i % 16 * 4) & 15;
+}
+
+struct Score {
+  // Tiers are compared lexicographically, then cost, then moves.
+  bool BetterThan(const Score& other) const {
+    if (auto c = tiers <=> other.tiers; c != 0) return c > 0;
+    if (cost != other.cost) return cost < other.cost;
+    return moves < other.moves;
+  }
+
+  // Raises every tier to the one of `other` and lowers the cost and moves to the ones of it, so
+  // that a bound of several subtrees is the join of their bounds.
+  void Join(const Score& other) {
+    for (uint8_t k = 0; k != kMaxTiers; ++k) tiers[k] = max(tiers[k], other.tiers[k]);
+    cost = min(cost, other.cost);
+    moves = min(moves, other.moves);
+  }
+
+  // The weighted sum of the levels of stored tripods in every tier.
+  array<int32_t, kMaxTiers> tiers = {};
+  uint32_t cost = 0;
+  // How many items have to be put into the library or taken out of it. Only counted if the
+  // current content of the library is known; see Instance::placed.
+  uint16_t moves = 0;
+  // The number of picked items that aren't in the library yet, per row.
+  array<uint8_t, kRows> put_in = {};
+  Levels tripods = {};
+};
+
+// Items in the form that Optimize() wants them. Building an Instance is done once; searches over
+// the same items share it.
+struct Instance {
+  // Items with indices in `placed` are in the library already.
+  Instance(const vector<Item>& items, const vector<Class>& classes, const Book& book,
+           const vector<uint32_t>& placed = {})
+      : book(book), classes(classes), track_moves(!placed.empty()) {
+    if (classes.size() > kMaxClasses) throw runtime_error("too many classes");
+    vector<uint8_t> top_tier;
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      const Class& cls = classes[c];
+      if (cls.tripods.size() > 64) throw runtime_error("too many tripods in a class");
+      if (cls.tiers.size() >= kMaxTiers) throw runtime_error("too many tiers");
+      if (cls.weight < 1) throw runtime_error("class weight must be positive");
+      tiers = max<uint8_t>(tiers, cls.tiers.size() + 1);
+      for (uint8_t i = 0, k = 0, end = 0; i != cls.tripods.size(); ++i) {
+        while (k != cls.tiers.size() && i == end) end += cls.tiers[k++];
+        uint8_t t = cls.tripods[i];
+        // A tripod that is in different tiers for different classes goes with the top one.
+        uint8_t tier = i < end ? k - 1 : k;
+        if (places.size() <= t) {
+          places.resize(t + 1);
+          top_tier.resize(t + 1, kMaxTiers);
+        }
+        places[t].push_back({c, i});
+        top_tier[t] = min(top_tier[t], tier);
+        tier_of[c][i] = tier;
+        weight_of[c][i] = cls.weight;
+        tier_lanes[c][tier][i / 16] |= uint64_t{15} << (i % 16 * 4);
+      }
+      for (auto [t, w] : cls.weights) {
+        if (w < 1) throw runtime_error("tripod weight must be positive");
+        auto it = find(cls.tripods.begin(), cls.tripods.end(), t);
+        if (it != cls.tripods.end()) weight_of[c][it - cls.tripods.begin()] *= w;
+      }
+      for (uint8_t k = 0; k != tiers; ++k) {
+        set<int32_t> w;
+        for (uint8_t i = 0; i != cls.tripods.size(); ++i) {
+          if (tier_of[c][i] == k) w.insert(weight_of[c][i]);
+        }
+        if (w.size() == 1) tier_weights[c][k] = *w.begin();
+      }
+    }
+    order_of.assign(places.size(), -1);
+    for (uint8_t k = 0; k != tiers; ++k) {
+      for (const Class& cls : classes) {
+        for (uint8_t t : cls.tripods) {
+          if (top_tier[t] != k || order_of[t] >= 0) continue;
+          order_of[t] = order.size();
+          order.push_back(t);
+          order_places.push_back(places[t][0]);
+        }
+      }
+      if (k == 0) prio_depth = order.size();
+    }
+    candidates.resize(order.size());
+    candidate_levels.resize(order.size());
+    best_level.resize(order.size());
+    for (const Item& item : items) Add(item);
+    for (uint32_t i : placed) {
+      if (this->placed.at(i)) throw runtime_error("item is placed twice");
+      this->placed[i] = true;
+      if (++placed_in_row[rows[i]] > book[rows[i]]) throw runtime_error("too many placed items");
+    }
+    // Placed items aren't interchangeable with the rest, so twins need the placement.
+    twins.clear();
+    for (uint32_t i = 0; i != size(); ++i) SetTwin(i);
+  }
+
+  // Appends an item. It gets index size() - 1.
+  void Add(const Item& item) {
+    Levels v = {};
+    for (uint8_t j = 0; j != kTripods; ++j) {
+      uint8_t t = item.tripods[j];
+      uint8_t level = max<uint8_t>(item.levels[j], 1);
+      if (level > kMaxLevel) throw runtime_error("tripod level is too high");
+      if (!t || t >= places.size()) continue;
+      // An item that lists a tripod twice has its highest level.
+      for (auto [c, i] : places[t]) {
+        uint64_t& w = v[c * kClassWords + i / 16];
+        w = LaneMax(w, uint64_t{level} << (i % 16 * 4));
+      }
+    }
+    for (uint8_t j = 0; j != kTripods; ++j) {
+      uint8_t t = item.tripods[j];
+      if (!t || t >= places.size() || order_of[t] < 0) continue;
+      if (find(item.tripods, item.tripods + j, t) != item.tripods + j) continue;
+      auto [c, i] = places[t][0];
+      uint8_t level = Lane(v, c, i);
+      candidates[order_of[t]].push_back(size());
+      candidate_levels[order_of[t]].push_back(level);
+      best_level[order_of[t]] = max(best_level[order_of[t]], level);
+      max_level = max(max_level, level);
+    }
+    rows.push_back(item.row);
+    costs.push_back(item.cost);
+    tripods.push_back(v);
+    placed.push_back(false);
+    twin.push_back(-1);
+    SetTwin(size() - 1);
+    AddToRow(size() - 1);
+  }
+
+  // Removes the last item. It must be the last one added.
+  void Pop() {
+    uint32_t i = size() - 1;
+    for (size_t d = 0; d != order.size(); ++d) {
+      vector<uint32_t>& v = candidates[d];
+      if (v.empty() || v.back() != i) continue;
+      v.pop_back();
+      candidate_levels[d].pop_back();
+      best_level[d] = 0;
+      for (uint8_t level : candidate_levels[d]) best_level[d] = max(best_level[d], level);
+    }
+    max_level = 1;
+    for (uint8_t level : best_level) max_level = max(max_level, level);
+    auto it = twins.find({rows.back(), costs.back(), placed.back(), tripods.back()});
+    if (twin.back() < 0) {
+      twins.erase(it);
+    } else {
+      it->second = twin.back();
+    }
+    rows.pop_back();
+    costs.pop_back();
+    tripods.pop_back();
+    placed.pop_back();
+    twin.pop_back();
+    row_reach = {};
+    row_bits = {};
+    for (uint32_t j = 0; j != size(); ++j) AddToRow(j);
+  }
+
+  uint32_t size() const { return rows.size(); }
+
+  // Sorts the tripods of every tier so that the ones with the fewest candidates come first. The
+  // search then picks items for them in this order.
+  void SortTripodsByCandidates() {
+    vector<pair<uint8_t, size_t>> key(order.size());
+    for (size_t d = 0; d != order.size(); ++d) {
+      uint8_t tier = kMaxTiers;
+      for (auto [c, i] : places[order[d]]) tier = min(tier, tier_of[c][i]);
+      key[d] = {tier, candidates[d].size()};
+    }
+    vector<size_t> perm(order.size());
+    for (size_t d = 0; d != perm.size(); ++d) perm[d] = d;
+    stable_sort(perm.begin(), perm.end(), [&](size_t a, size_t b) { return key[a] < key[b]; });
+    PermuteTripods(perm);
+  }
+
+  // Breaks the ties of the usual order at random: shuffles the tripods of every tier and the
+  // candidates of every tripod. Pop() doesn't work for items added before this.
+  void Shuffle(mt19937_64& rng) {
+    vector<pair<uint8_t, uint64_t>> key(order.size());
+    for (size_t d = 0; d != order.size(); ++d) {
+      uint8_t tier = kMaxTiers;
+      for (auto [c, i] : places[order[d]]) tier = min(tier, tier_of[c][i]);
+      key[d] = {tier, rng()};
+    }
+    vector<size_t> perm(order.size());
+    for (size_t d = 0; d != perm.size(); ++d) perm[d] = d;
+    sort(perm.begin(), perm.end(), [&](size_t a, size_t b) { return key[a] < key[b]; });
+    PermuteTripods(perm);
+    for (size_t d = 0; d != order.size(); ++d) {
+      for (size_t a = candidates[d].size(); a > 1; --a) {
+        size_t b = rng() % a;
+        swap(candidates[d][a - 1], candidates[d][b]);
+        swap(candidate_levels[d][a - 1], candidate_levels[d][b]);
+      }
+    }
+  }
+
+  // Moves the tripod at depth perm[d] of the search to depth d.
+  void PermuteTripods(const vector<size_t>& perm) {
+    auto permute = [&](auto& v) {
+      auto old = v;
+      for (size_t d = 0; d != perm.size(); ++d) v[d] = move(old[perm[d]]);
+    };
+    permute(order);
+    permute(order_places);
+    permute(candidates);
+    permute(candidate_levels);
+    permute(best_level);
+    for (size_t d = 0; d != order.size(); ++d) order_of[order[d]] = d;
+  }
+
+  // Sorts the candidates of every tripod by cost, the cheapest first. The search then tries them
+  // in this order. Pop() doesn't work for items added before this.
+  void SortCandidatesByCost() {
+    for (size_t d = 0; d != order.size(); ++d) {
+      vector<pair<uint32_t, uint8_t>> v;
+      for (size_t a = 0; a != candidates[d].size(); ++a) {
+        v.push_back({candidates[d][a], candidate_levels[d][a]});
+      }
+      stable_sort(v.begin(), v.end(), [&](auto x, auto y) {
+        return costs[x.first] < costs[y.first];
+      });
+      for (size_t a = 0; a != v.size(); ++a) tie(candidates[d][a], candidate_levels[d][a]) = v[a];
+    }
+  }
+
+  // Adds the item to a solution with score `s`.
+  void Add(Score& s, uint32_t item) const {
+    s.cost += costs[item];
+    if (track_moves && !placed[item]) {
+      // Putting the item in takes one move. Once the row has no room left for the items that
+      // are in it now, every such item takes one more move to take it out.
+      uint8_t row = rows[item];
+      s.moves += 1 + (++s.put_in[row] + placed_in_row[row] > book[row]);
+    }
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      for (uint8_t w = 0; w != kClassWords; ++w) {
+        size_t j = c * kClassWords + w;
+        if (!tripods[item][j]) continue;
+        uint64_t old = s.tripods[j];
+        s.tripods[j] = LaneMax(old, tripods[item][j]);
+        uint64_t gain = s.tripods[j] - old;
+        for (uint64_t m = NonZeroLanes(gain); m; m &= m - 1) {
+          int lane = countr_zero(m);
+          uint8_t i = w * 16 + lane / 4;
+          s.tiers[tier_of[c][i]] += weight_of[c][i] * (gain >> lane & 15);
+        }
+      }
+    }
+  }
+
+  // The moves of a solution that puts put_in[r] new items into row r of the library, if every row
+  // has `extra` more slots than `book`. Add() counts them for extra == 0.
+  uint16_t Moves(const array<uint8_t, kRows>& put_in, uint8_t extra) const {
+    int res = 0;
+    for (uint8_t r = 0; r != kRows; ++r) {
+      res += put_in[r] + max(0, put_in[r] + placed_in_row[r] - book[r] - extra);
+    }
+    return res;
+  }
+
+  // Returns false if no solution extending `s` can beat `best` given the free slots in `book`.
+  // Tiers are bounded one by one until one of them decides the comparison.
+  bool MayImprove(const Score& s, const Book& book, const Score& best) const {
+    int res = -1;
+    ForTierBounds(s, book, [&](uint8_t k, int32_t bound) {
+      if (bound != best.tiers[k]) res = bound > best.tiers[k];
+      return res < 0;
+    });
+    if (res >= 0) return res;
+    // Moves never go down as items are added.
+    if (s.cost != best.cost) return s.cost < best.cost;
+    return s.moves < best.moves;
+  }
+
+  // Returns a score that no solution extending `s` can beat in any tier given the free slots in
+  // `book`. Its cost and moves are the ones of `s`, which only grow as items are added.
+  Score Bound(const Score& s, const Book& book) const {
+    Score res = s;
+    ForTierBounds(s, book, [&](uint8_t k, int32_t bound) {
+      res.tiers[k] = bound;
+      return true;
+    });
+    return res;
+  }
+
+  // Calls f(k, bound) with an upper bound of tier k of the solutions extending `s` for k = 0,
+  // 1, ... while f returns true.
+  //
+  // Every class and tier is bounded separately. The rows with free slots give the best level
+  // each tripod can still reach, and at most `fit` tripods can still improve. A tier gains the
+  // sum of these improvements, but no more than `fit` of the largest ones.
+  template <class F>
+  void ForTierBounds(const Score& s, const Book& book, F&& f) const {
+    uint8_t rows_with_slots = 0;
+    for (uint8_t r = 0; r != kRows; ++r) rows_with_slots |= !!book[r] << r;
+    const Levels& reach = row_reach[rows_with_slots];
+    array<array<uint64_t, kClassWords>, kMaxClasses> gain;
+    array<int, kMaxClasses> fit = {};
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      for (uint8_t r = 0; r != kRows; ++r) fit[c] += book[r] * row_bits[r][c];
+      for (uint8_t w = 0; w != kClassWords; ++w) {
+        size_t j = c * kClassWords + w;
+        gain[c][w] = LaneMax(reach[j], s.tripods[j]) - s.tripods[j];
+      }
+    }
+    for (uint8_t k = 0; k != tiers; ++k) {
+      int32_t bound = s.tiers[k];
+      for (uint8_t c = 0; c != classes.size(); ++c) {
+        if (tier_weights[c][k]) {
+          int sum = 0;
+          for (uint8_t w = 0; w != kClassWords; ++w) {
+            sum += LaneSum(gain[c][w] & tier_lanes[c][k][w]);
+          }
+          bound += tier_weights[c][k] * min(sum, fit[c] * max_level);
+          continue;
+        }
+        array<int32_t, 64> v;
+        int n = 0;
+        for (uint8_t w = 0; w != kClassWords; ++w) {
+          uint64_t g = gain[c][w] & tier_lanes[c][k][w];
+          for (uint64_t m = NonZeroLanes(g); m; m &= m - 1) {
+            int lane = countr_zero(m);
+            v[n++] = weight_of[c][w * 16 + lane / 4] * (g >> lane & 15);
+          }
+        }
+        if (n > fit[c]) {
+          nth_element(v.begin(), v.begin() + fit[c], v.begin() + n, greater<>());
+          n = fit[c];
+        }
+        for (int i = 0; i != n; ++i) bound += v[i];
+      }
+      if (!f(k, bound)) return;
+    }
+  }
+
+  // Whether all tripods of the top tier of all classes are stored.
+  bool HasAllPrio(const Score& s) const {
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      for (uint8_t w = 0; w != kClassWords; ++w) {
+        uint64_t prio = tier_lanes[c][0][w] & kLanes;
+        if ((NonZeroLanes(s.tripods[c * kClassWords + w]) & prio) != prio) return false;
+      }
+    }
+    return true;
+  }
+
+  // Prints score as "top tier/top two tiers/.../all tiers/cost". With two tiers, it's
+  // "high-priority/all/cost".
+  string Format(const Score& score) const {
+    string res;
+    for (int k = 0, sum = 0; k != tiers; ++k) res += to_string(sum += score.tiers[k]) + '/';
+    return res + to_string(score.cost);
+  }
+
+  // Prints levels of the tripods of class c, the last tripod first.
+  string FormatLevels(const Score& score, uint8_t c) const {
+    string res;
+    for (int i = 63; i >= 0; --i) res += '0' + Lane(score.tripods, c, i);
+    return res;
+  }
+
+  // A unit is level l of tripod i of class c, with index (c * 64 + i) * kMaxLevel + l - 1.
+  // Reaching a unit adds its weight to the tier of the tripod.
+  size_t units() const { return classes.size() * 64 * kMaxLevel; }
+
+  int32_t UnitWeight(size_t u) const { return weight_of[u / (64 * kMaxLevel)][u / kMaxLevel % 64]; }
+
+  // Calls f(u) for every unit of tier k that `to` reaches and `from` doesn't.
+  template <class F>
+  void ForUnits(uint8_t k, const Levels& from, const Levels& to, F&& f) const {
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      for (uint8_t w = 0; w != kClassWords; ++w) {
+        size_t x = c * kClassWords + w;
+        uint64_t g = (to[x] - from[x]) & tier_lanes[c][k][w];
+        for (uint64_t m = NonZeroLanes(g); m; m &= m - 1) {
+          int lane = countr_zero(m);
+          size_t base = (c * 64 + w * 16 + lane / 4) * kMaxLevel;
+          int first = from[x] >> lane & 15, last = to[x] >> lane & 15;
+          for (int l = first + 1; l <= last; ++l) f(base + l - 1);
+        }
+      }
+    }
+  }
+
+  // A hash of everything that the search tree depends on: the book, the tiers and weights, the
+  // items in order and the candidates of every tripod in order.
+  uint64_t Fingerprint() const {
+    string bytes;
+    auto put = [&](const auto& x) {
+      bytes.append(reinterpret_cast<const char*>(&x), sizeof(x));
+    };
+    put(book);
+    put(tiers);
+    put(tier_of);
+    put(weight_of);
+    put(track_moves);
+    for (uint32_t i = 0; i != size(); ++i) {
+      put(rows[i]);
+      put(costs[i]);
+      put(bool(placed[i]));
+      put(tripods[i]);
+    }
+    for (size_t d = 0; d != order.size(); ++d) {
+      put(order[d]);
+      for (size_t a = 0; a != candidates[d].size(); ++a) {
+        put(candidates[d][a]);
+        put(candidate_levels[d][a]);
+      }
+    }
+    return Fnv1a(bytes);
+  }
+
+  // Writes the instance and the items it was built from to a new file and renames it to
+  // `path`. Load() reads it back without the work of the constructor.
+  void Save(const string& path, const vector<Item>& items) const {
+    string tmp = path + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      auto put_pod = [&](const auto& x) {
+        out.write(reinterpret_cast<const char*>(&x), sizeof(x));
+      };
+      auto put = [&](const auto& v) {
+        put_pod(uint64_t{v.size()});
+        out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(v[0]));
+      };
+      // Nested vectors go as the offsets of the inner ones and their concatenation.
+      auto put_nested = [&](const auto& vv) {
+        vector<uint64_t> offsets = {0};
+        vector<typename decay_t<decltype(vv)>::value_type::value_type> flat;
+        for (const auto& v : vv) {
+          flat.insert(flat.end(), v.begin(), v.end());
+          offsets.push_back(flat.size());
+        }
+        put(offsets);
+        put(flat);
+      };
+      out.write(kMagic, sizeof(kMagic));
+      put_pod(kLayout);
+      // Items as an array of every field.
+      vector<uint8_t> item_rows, item_tripods, item_levels;
+      vector<uint16_t> item_costs;
+      for (const Item& item : items) {
+        item_rows.push_back(item.row);
+        item_costs.push_back(item.cost);
+        item_tripods.insert(item_tripods.end(), item.tripods, item.tripods + kTripods);
+        item_levels.insert(item_levels.end(), item.levels, item.levels + kTripods);
+      }
+      put(item_rows);
+      put(item_costs);
+      put(item_tripods);
+      put(item_levels);
+      put_pod(classes.size());
+      for (const Class& cls : classes) {
+        put(cls.tripods);
+        put(cls.tiers);
+        put(cls.weights);
+        put_pod(cls.weight);
+      }
+      put_pod(book);
+      put_pod(tiers);
+      put_pod(tier_of);
+      put_pod(weight_of);
+      put_pod(tier_lanes);
+      put_pod(tier_weights);
+      put_pod(max_level);
+      put_nested(places);
+      put(order);
+      put_pod(prio_depth);
+      put(order_of);
+      put(order_places);
+      put(rows);
+      put(costs);
+      put(tripods);
+      put(vector<uint8_t>(placed.begin(), placed.end()));
+      put_pod(track_moves);
+      put_pod(placed_in_row);
+      put_nested(candidates);
+      put_nested(candidate_levels);
+      put(best_level);
+      put_pod(row_reach);
+      put_pod(row_bits);
+      if (!out.flush()) throw runtime_error("cannot write " + tmp);
+    }
+    if (rename(tmp.c_str(), path.c_str())) throw runtime_error("cannot write " + path);
+  }
+
+  // Reads an instance that Save() wrote to `path` and replaces `items` with its items. The
+  // tables get copied as they are, and checked enough to keep the search within them. Twins
+  // aren't saved: a pass over the items with one map lookup each finds them again.
+  static Instance Load(const string& path, vector<Item>& items) {
+    ifstream in(path, ios::binary);
+    if (!in) throw runtime_error("cannot open " + path);
+    const string data{istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+    const char* p = data.data();
+    const char* end = p + data.size();
+    auto fail = [&] { throw runtime_error("bad instance " + path); };
+    auto take = [&](void* to, uint64_t n) {
+      if (uint64_t(end - p) < n) fail();
+      if (n) memcpy(to, p, n);
+      p += n;
+    };
+    auto get_pod = [&](auto& x) { take(&x, sizeof(x)); };
+    auto get = [&](auto& v) {
+      uint64_t n = 0;
+      get_pod(n);
+      if (n > uint64_t(end - p) / sizeof(v[0])) fail();
+      v.resize(n);
+      take(v.data(), n * sizeof(v[0]));
+    };
+    auto get_nested = [&](auto& vv) {
+      vector<uint64_t> offsets;
+      typename decay_t<decltype(vv)>::value_type flat;
+      get(offsets);
+      get(flat);
+      vv.clear();
+      for (size_t i = 1; i < offsets.size(); ++i) {
+        if (offsets[i - 1] > offsets[i] || offsets[i] > flat.size()) fail();
+        vv.emplace_back(flat.begin() + offsets[i - 1], flat.begin() + offsets[i]);
+      }
+    };
+    // Whether every lane of the levels is at most kMaxLevel.
+    auto valid_levels = [](const Levels& v) {
+      return all_of(v.begin(), v.end(), [](uint64_t w) {
+        for (int lane = 0; lane != 64; lane += 4) {
+          if ((w >> lane & 15) > kMaxLevel) return false;
+        }
+        return true;
+      });
+    };
+
+    char magic[sizeof(kMagic)];
+    get_pod(magic);
+    if (!equal(magic, magic + sizeof(magic), kMagic)) fail();
+    array<uint32_t, kLayout.size()> layout;
+    get_pod(layout);
+    if (layout != kLayout) throw runtime_error(path + " is from another build");
+    vector<uint8_t> item_rows, item_tripods, item_levels;
+    vector<uint16_t> item_costs;
+    get(item_rows);
+    get(item_costs);
+    get(item_tripods);
+    get(item_levels);
+    if (item_costs.size() != item_rows.size() ||
+        item_tripods.size() != item_rows.size() * kTripods ||
+        item_levels.size() != item_tripods.size() ||
+        any_of(item_rows.begin(), item_rows.end(), [](uint8_t r) { return r >= kRows; }) ||
+        any_of(item_levels.begin(), item_levels.end(), [](uint8_t l) { return l > kMaxLevel; })) {
+      fail();
+    }
+    items.clear();
+    for (size_t i = 0; i != item_rows.size(); ++i) {
+      const uint8_t* t = &item_tripods[i * kTripods];
+      const uint8_t* l = &item_levels[i * kTripods];
+      items.push_back({item_rows[i], item_costs[i], {t[0], t[1], t[2]}, {l[0], l[1], l[2]}});
+    }
+    Instance res;
+    size_t n = 0;
+    get_pod(n);
+    if (n > kMaxClasses) fail();
+    res.classes.resize(n);
+    for (Class& cls : res.classes) {
+      get(cls.tripods);
+      get(cls.tiers);
+      get(cls.weights);
+      get_pod(cls.weight);
+      if (cls.tripods.size() > 64 || cls.tiers.size() >= kMaxTiers) fail();
+    }
+    get_pod(res.book);
+    get_pod(res.tiers);
+    get_pod(res.tier_of);
+    get_pod(res.weight_of);
+    get_pod(res.tier_lanes);
+    get_pod(res.tier_weights);
+    get_pod(res.max_level);
+    get_nested(res.places);
+    get(res.order);
+    get_pod(res.prio_depth);
+    get(res.order_of);
+    get(res.order_places);
+    get(res.rows);
+    get(res.costs);
+    get(res.tripods);
+    vector<uint8_t> placed;
+    get(placed);
+    res.placed.assign(placed.begin(), placed.end());
+    if (res.placed.size() == items.size() && res.rows.size() == items.size() &&
+        res.costs.size() == items.size() && res.tripods.size() == items.size()) {
+      res.twin.resize(items.size());
+      for (uint32_t i = 0; i != items.size(); ++i) res.SetTwin(i);
+    }
+    uint8_t track_moves = 0;
+    get_pod(track_moves);
+    if (track_moves > 1) fail();
+    res.track_moves = track_moves;
+    get_pod(res.placed_in_row);
+    get_nested(res.candidates);
+    get_nested(res.candidate_levels);
+    get(res.best_level);
+    get_pod(res.row_reach);
+    get_pod(res.row_bits);
+    if (p != end) fail();
+
+    const size_t size = items.size(), depth = res.order.size();
+    bool ok = res.tiers >= 1 && res.tiers <= kMaxTiers && res.max_level >= 1 &&
+              res.max_level <= kMaxLevel && res.rows.size() == size && res.costs.size() == size &&
+              res.tripods.size() == size && res.placed.size() == size && res.twin.size() == size &&
+              res.order_of.size() == res.places.size() && res.order_places.size() == depth &&
+              res.candidates.size() == depth && res.candidate_levels.size() == depth &&
+              res.best_level.size() == depth && res.prio_depth <= depth &&
+              all_of(res.row_reach.begin(), res.row_reach.end(), valid_levels);
+    // Weights of tripods are positive, and ones this large would overflow the tiers of a score.
+    // Lanes past the tripods of a class and tiers with mixed weights have zeros.
+    auto valid_weight = [](int32_t w) { return w >= 0 && w <= 1 << 16; };
+    for (uint8_t c = 0; ok && c != res.classes.size(); ++c) {
+      const Class& cls = res.classes[c];
+      ok = cls.weight >= 1 &&
+           all_of(cls.weights.begin(), cls.weights.end(), [](auto w) { return w.second >= 1; }) &&
+           all_of(res.tier_of[c].begin(), res.tier_of[c].end(),
+                  [&](uint8_t k) { return k < res.tiers; }) &&
+           all_of(res.weight_of[c].begin(), res.weight_of[c].end(), valid_weight) &&
+           all_of(res.weight_of[c].begin(), res.weight_of[c].begin() + cls.tripods.size(),
+                  [](int32_t w) { return w >= 1; }) &&
+           all_of(res.tier_weights[c].begin(), res.tier_weights[c].end(), valid_weight);
+    }
+    for (size_t t = 0; ok && t != res.places.size(); ++t) {
+      ok = all_of(res.places[t].begin(), res.places[t].end(), [&](auto place) {
+        return place.first < res.classes.size() && place.second < 64;
+      });
+      ok = ok && res.order_of[t] >= -1 && res.order_of[t] < int(depth) &&
+           (res.order_of[t] < 0 || res.order[res.order_of[t]] == t);
+    }
+    for (uint8_t r = 0; ok && r != kRows; ++r) {
+      ok = res.placed_in_row[r] <= res.book[r] &&
+           all_of(res.row_bits[r].begin(), res.row_bits[r].end(),
+                  [](uint8_t bits) { return bits <= 64; });
+    }
+    for (size_t i = 0; ok && i != size; ++i) {
+      ok = res.rows[i] < kRows && valid_levels(res.tripods[i]);
+    }
+    for (size_t d = 0; ok && d != depth; ++d) {
+      const vector<uint8_t>& levels = res.candidate_levels[d];
+      ok = res.order[d] < res.places.size() && res.order_of[res.order[d]] == int(d) &&
+           !res.places[res.order[d]].empty() &&
+           res.order_places[d] == res.places[res.order[d]][0] &&
+           levels.size() == res.candidates[d].size() && res.best_level[d] <= kMaxLevel &&
+           all_of(res.candidates[d].begin(), res.candidates[d].end(),
+                  [&](uint32_t i) { return i < size; }) &&
+           all_of(levels.begin(), levels.end(), [](uint8_t l) { return l <= kMaxLevel; });
+    }
+    if (!ok) fail();
+    return res;
+  }
+
+  static constexpr char kMagic[8] = {'l', 'a', 't', 'r', 'i', 'p', 'i', '3'};
+  // Constants that the layout of the file depends on.
+  static constexpr array<uint32_t, 6> kLayout = {kRows,     kTripods,    kMaxClasses,
+                                                 kMaxTiers, kClassWords, kMaxLevel};
+
+  Book book;
+  vector<Class> classes;
+  // The number of tiers. Tiers past the last one of a class are empty for it.
+  uint8_t tiers = 0;
+
+  // Tier and weight of every tripod of every class, indexed by (class, bit). Weights include
+  // the weight of the class.
+  array<array<uint8_t, 64>, kMaxClasses> tier_of = {};
+  array<array<int32_t, 64>, kMaxClasses> weight_of = {};
+  // Lanes of every tier and class, all 4 bits of a lane set.
+  array<array<array<uint64_t, kClassWords>, kMaxTiers>, kMaxClasses> tier_lanes = {};
+  // The weight shared by all tripods of a tier and class, or zero if they have different weights.
+  array<array<int32_t, kMaxTiers>, kMaxClasses> tier_weights = {};
+  // The highest level of any tripod on any item.
+  uint8_t max_level = 1;
+
+  // places[t] lists (class, lane) pairs of tripod t.
+  vector<vector<pair<uint8_t, uint8_t>>> places;
+
+  // Optimize() picks an item for each of these tripods in order, tier by tier. There are
+  // prio_depth tripods in the top tier.
+  vector<uint8_t> order;
+  size_t prio_depth;
+  // The inverse of order: order[order_of[t]] == t, or -1 if no class uses tripod t.
+  vector<int> order_of;
+  // order_places[d] == places[order[d]][0].
+  vector<pair<uint8_t, uint8_t>> order_places;
+
+  // Row, cost and tripods of every item, and whether it's in the library now.
+  vector<uint8_t> rows;
+  vector<uint16_t> costs;
+  vector<Levels> tripods;
+  vector<bool> placed;
+  // Items with the same row, cost and tripods that are both in the library or both not are
+  // interchangeable. twin[i] is the last such item before item i, or -1. The search picks an
+  // item only if its twin is used, so it tries every set of interchangeable items once.
+  vector<int> twin;
+  // The last item with every row, cost, placement and tripods.
+  map<tuple<uint8_t, uint16_t, bool, Levels>, uint32_t> twins;
+
+  // Optimize() bounds nodes up to this deep with LpMayImprove(), -1 to never do it.
+  int lp_depth = 2;
+  // Whether Optimize() bounds every node with the Lagrangian relaxation. It always uses it to
+  // exclude items at the root.
+  bool lagrangian = false;
+  // Whether the search bounds every node with TopGains.
+  bool top_gains = true;
+  // If positive, Optimize() prints an estimate of the size of its search tree before the search
+  // and its progress every this many seconds. See Search::Estimate().
+  int progress = 0;
+
+  // Whether Score::moves is counted, and how many items are in every row of the library now.
+  bool track_moves;
+  Book placed_in_row = {};
+
+  // candidates[d] has indices of all items that provide tripod order[d], and candidate_levels[d]
+  // has the levels of this tripod on them. best_level[d] is the highest of these levels.
+  vector<vector<uint32_t>> candidates;
+  vector<vector<uint8_t>> candidate_levels;
+  vector<uint8_t> best_level;
+
+  // row_reach[m] has the highest level of every tripod on items in the rows from bitmask m.
+  // row_bits[r][c] is the largest number of tripods of class c on an item in row r.
+  array<Levels, 1 << kRows> row_reach = {};
+  array<array<uint8_t, kMaxClasses>, kRows> row_bits = {};
+
+ private:
+  // For Load().
+  Instance() = default;
+
+  // Sets twin[i] to the last item before item i with the same row, cost, placement and
+  // tripods, and makes item i the last one for the next items.
+  void SetTwin(uint32_t i) {
+    auto [it, added] = twins.insert({{rows[i], costs[i], placed[i], tripods[i]}, i});
+    twin[i] = added ? -1 : exchange(it->second, i);
+  }
+
+  void AddToRow(uint32_t item) {
+    uint8_t row = rows[item];
+    for (uint8_t m = 0; m != row_reach.size(); ++m) {
+      if (!(m >> row & 1)) continue;
+      for (size_t j = 0; j != classes.size() * kClassWords; ++j) {
+        row_reach[m][j] = LaneMax(row_reach[m][j], tripods[item][j]);
+      }
+    }
+    for (uint8_t c = 0; c != classes.size(); ++c) {
+      int bits = 0;
+      for (uint8_t w = 0; w != kClassWords; ++w) {
+        bits += popcount(NonZeroLanes(tripods[item][c * kClassWords + w]));
+      }
+      row_bits[row][c] = max<uint8_t>(row_bits[row][c], bits);
+    }
+  }
+};
+
+struct Solution {
+  Score score;
+  // Indices of the used items in ascending order.
+  vector<uint32_t> items;
+};
+
+// Maximizes obj·x subject to a·x <= b and 0 <= x <= upper with the dense bounded-variable simplex
+// method. All of b must be non-negative, so that x = 0 is feasible.
+struct Simplex {
+  static constexpr double kEps = 1e-9;
+
+  // Returns false if the method doesn't converge. Otherwise fills value and reduced.
+  bool Solve() {
+    const size_t m = b.size(), n = obj.size(), w = n + m;
+    // The tableau: row i says that variable basis[i] plus t[i]·x equals rhs[i], where x are the
+    // nonbasic variables. A variable j with flipped[j] is replaced with upper[j] - x[j].
+    vector<double> t(m * w), rhs = b, d(w), u(w, numeric_limits<double>::infinity());
+    vector<size_t> basis(m);
+    vector<bool> flipped(w);
+    for (size_t i = 0; i != m; ++i) {
+      copy(a[i].begin(), a[i].end(), t.begin() + i * w);
+      t[i * w + n + i] = 1;
+      basis[i] = n + i;
+    }
+    copy(obj.begin(), obj.end(), d.begin());
+    copy(upper.begin(), upper.end(), u.begin());
+    value = 0;
+
+    // Moves nonbasic variable j to its other bound.
+    auto flip = [&](size_t j) {
+      for (size_t i = 0; i != m; ++i) {
+        rhs[i] -= t[i * w + j] * u[j];
+        t[i * w + j] = -t[i * w + j];
+      }
+      value += d[j] * u[j];
+      d[j] = -d[j];
+      flipped[j] = !flipped[j];
+    };
+
+    // Dantzig's rule is fast, Bland's rule never cycles. Switch to Bland's after a run of
+    // degenerate pivots.
+    for (size_t iter = 0, degenerate = 0; iter != 50 * w; ++iter) {
+      const bool bland = degenerate > m;
+      size_t e = w;
+      for (size_t j = 0; j != w && !(bland && e != w); ++j) {
+        if (d[j] > kEps && (e == w || d[j] > d[e])) e = j;
+      }
+      if (e == w) {
+        reduced.assign(n, 0);
+        vector<bool> basic(w);
+        for (size_t j : basis) basic[j] = true;
+        for (size_t j = 0; j != n; ++j) {
+          if (!basic[j] && !flipped[j]) reduced[j] = d[j];
+        }
+        return true;
+      }
+
+      // Increase x[e] until it or a basic variable hits a bound.
+      double step = u[e];
+      size_t leave = m;
+      for (size_t i = 0; i != m; ++i) {
+        double v = t[i * w + e];
+        double r = v > kEps    ? rhs[i] / v
+                   : v < -kEps ? (u[basis[i]] - rhs[i]) / -v
+                               : numeric_limits<double>::infinity();
+        // Rounding errors may leave rhs slightly out of bounds.
+        r = max(r, 0.0);
+        if (r < step || (r == step && leave != m && basis[i] < basis[leave])) {
+          step = r;
+          leave = i;
+        }
+      }
+      if (step == numeric_limits<double>::infinity()) return false;
+      degenerate = step < kEps ? degenerate + 1 : 0;
+      if (leave == m) {
+        flip(e);
+        continue;
+      }
+
+      double* row = &t[leave * w];
+      if (row[e] < 0) {
+        // The leaving variable goes to its upper bound.
+        for (size_t j = 0; j != w; ++j) row[j] = -row[j];
+        row[basis[leave]] = 1;
+        rhs[leave] = u[basis[leave]] - rhs[leave];
+        flipped[basis[leave]] = !flipped[basis[leave]];
+      }
+      const double p = row[e];
+      for (size_t j = 0; j != w; ++j) row[j] /= p;
+      rhs[leave] /= p;
+      for (size_t i = 0; i != m; ++i) {
+        double f = t[i * w + e];
+        if (i == leave || !f) continue;
+        for (size_t j = 0; j != w; ++j) t[i * w + j] -= f * row[j];
+        rhs[i] -= f * rhs[leave];
+      }
+      value += d[e] * rhs[leave];
+      const double f = d[e];
+      for (size_t j = 0; j != w; ++j) d[j] -= f * row[j];
+      basis[leave] = e;
+    }
+    return false;
+  }
+
+  vector<vector<double>> a;
+  vector<double> b;
+  vector<double> obj;
+  vector<double> upper;
+
+  // The optimal value.
+  double value;
+  // For every variable at zero, how much the optimal value changes per unit of it. Raising the
+  // variable to v gives at most value + v * reduced[j]. Zero for other variables.
+  vector<double> reduced;
+};
+
+// Incremental state that follows the items that Search picks.
+struct Tracker {
+  virtual ~Tracker() = default;
+  // `before` and `after` are the scores without and with the item. Search::used already has the
+  // item in both calls.
+  virtual void Pick(uint32_t item, const Score& before, const Score& after) = 0;
+  virtual void Unpick(uint32_t item, const Score& before, const Score& after) = 0;
+};
+
+// Depth-first search over sets of items. Level d of the search tree picks an item for tripod
+// Instance::order[d] unless it's already stored at the best level.
+struct Search {
+  // Every node of the search tree uses all items in `forced`. `book` has the number of slots in
+  // every row. The search picks items only for tripods order[floor], order[floor + 1], ..., so
+  // forcing the item picked for order[floor - 1] searches the subtree of that pick.
+  Search(const Instance& instance, const Book& book, const vector<uint32_t>& forced,
+         size_t floor = 0)
+      : instance(instance),
+        book(book),
+        floor(floor),
+        used(instance.size()),
+        banned(instance.size()),
+        scores(1) {
+    scores.reserve(instance.candidates.size() + 1);
+    for (uint32_t i : forced) {
+      if (used[i] || !this->book[instance.rows[i]]) {
+        scores.clear();
+        return;
+      }
+      used[i] = true;
+      --this->book[instance.rows[i]];
+      instance.Add(scores.back(), i);
+    }
+  }
+
+  // Calls visit(s, leaf) for every node of the search tree, the root first. `s` is the score of
+  // the used items, and `leaf` is true if the node has no children. The search goes down into
+  // the children of a node only if visit() returns true.
+  //
+  // Returns false if it stopped early because of Pause(). Then the next call continues where
+  // this one stopped.
+  template <class Visit>
+  bool Run(Visit&& visit) {
+    const vector<vector<uint32_t>>& candidates = instance.candidates;
+    if (scores.empty()) return true;
+    if (!nodes++) {
+      if (size_t limit = DepthLimit(scores.back());
+          visit(scores.back(), limit <= floor) && keep == kNone) {
+        assignments.assign(limit, kNone);
+      }
+      keep = kNone;
+    }
+
+    while (assignments.size() > floor) {
+      if (pause) {
+        pause = false;
+        return false;
+      }
+      size_t depth = assignments.size() - 1;
+      const vector<uint32_t>& v = candidates[depth];
+      const vector<uint8_t>& levels = instance.candidate_levels[depth];
+      size_t& a = assignments.back();
+      auto [c, i] = instance.order_places[depth];
+
+      if (a != kNone) Unpick(v[a]);
+      // Only items with a higher level of the tripod than the one already stored are of
+      // interest.
+      const uint8_t stored = Lane(scores.back().tripods, c, i);
+      if (a == kNone && stored >= instance.best_level[depth]) goto pop;
+
+      do {
+        ++a;
+        if (a == v.size()) goto pop;
+      } while (!MayPick(v[a], levels[a], stored));
+
+      ++nodes;
+      Pick(v[a]);
+
+      if (size_t limit = DepthLimit(scores.back());
+          visit(scores.back(), depth + 1 >= limit) && depth + 1 < limit && keep == kNone) {
+        assignments.resize(limit, kNone);
+      }
+      // Backjump: unpick the items of all levels past the ones to keep.
+      for (; keep != kNone && assignments.size() > keep; assignments.pop_back()) {
+        size_t d = assignments.size() - 1;
+        if (assignments[d] != kNone) Unpick(candidates[d][assignments[d]]);
+      }
+      keep = kNone;
+      continue;
+
+    pop:
+      assignments.pop_back();
+    }
+    return true;
+  }
+
+  // Makes Run() return before it visits the next node. Must be called from visit().
+  void Pause() { pause = true; }
+
+  // Appends the children of the current node that pick items for tripods order[from], ...,
+  // order[to - 1] to `res` as (depth, item), in the order Run() visits them.
+  void Children(size_t from, size_t to, vector<pair<size_t, uint32_t>>& res) const {
+    for (size_t d = to; d-- > from;) {
+      auto [c, i] = instance.order_places[d];
+      const uint8_t stored = Lane(scores.back().tripods, c, i);
+      if (stored >= instance.best_level[d]) continue;
+      for (size_t a = 0; a != instance.candidates[d].size(); ++a) {
+        uint32_t j = instance.candidates[d][a];
+        if (MayPick(j, instance.candidate_levels[d][a], stored)) res.push_back({d, j});
+      }
+    }
+  }
+
+  // Estimates how many more nodes Run() visits with Knuth's random probes, if it only prunes
+  // nodes that fail Instance::MayImprove() against `best`. The rest of the search is the
+  // children that every node on the current path has yet to visit. For every node on the path,
+  // `probes` random walks go down from random such children, and each walk estimates the size of
+  // the subtree as 1 + b1 + b1 b2 + ..., where bi is the number of children of its i-th node.
+  double Estimate(const Score& best, int probes, mt19937_64& rng) const {
+    if (scores.empty()) return 0;
+    Search copy = *this;
+    copy.trackers.clear();
+    double res = 0;
+    if (!nodes) {
+      res = 1;
+      if (!instance.MayImprove(scores.back(), book, best)) return res;
+      copy.assignments.assign(DepthLimit(scores.back()), kNone);
+    }
+    copy.ForPendingChildren([&](const vector<pair<size_t, uint32_t>>& children) {
+      if (children.empty()) return;
+      double sum = 0;
+      for (int p = 0; p != probes; ++p) {
+        auto [d, j] = children[rng() % children.size()];
+        copy.Pick(j);
+        sum += copy.Probe(d + 1, best, rng);
+        copy.Unpick(j);
+      }
+      res += children.size() * sum / probes;
+    });
+    return res;
+  }
+
+  // Returns a score that no solution in the rest of the search can beat in any tier, given that
+  // the visited nodes can't beat `best`. Its tiers are the highest ones of `best` and of
+  // Instance::Bound() of every child that a node on the current path has yet to visit, and its
+  // cost and moves are the lowest ones.
+  Score Bound(const Score& best) const {
+    Score res = best;
+    if (scores.empty()) return res;
+    if (!nodes) {
+      res.Join(instance.Bound(scores.back(), book));
+      return res;
+    }
+    Search copy = *this;
+    copy.trackers.clear();
+    copy.ForPendingChildren([&](const vector<pair<size_t, uint32_t>>& children) {
+      for (auto [d, j] : children) {
+        copy.Pick(j);
+        res.Join(instance.Bound(copy.scores.back(), copy.book));
+        copy.Unpick(j);
+      }
+    });
+    return res;
+  }
+
+  // Continues a search that was paused when it had the given assignments and had visited the
+  // given number of nodes: picks the items of the assignments again, so the next Run() goes on
+  // from there. Bans that the visitor made on the way are lost, so the rest of the search may
+  // visit more nodes than it would have.
+  void Resume(const vector<size_t>& saved, uint64_t visited) {
+    if (saved.size() > instance.candidates.size()) throw runtime_error("bad search state");
+    for (size_t d = 0; d != saved.size(); ++d) {
+      assignments.push_back(saved[d]);
+      if (saved[d] == kNone) continue;
+      if (saved[d] >= instance.candidates[d].size()) throw runtime_error("bad search state");
+      uint32_t j = instance.candidates[d][saved[d]];
+      if (used[j] || !book[instance.rows[j]]) throw runtime_error("bad search state");
+      Pick(j);
+    }
+    nodes = visited;
+  }
+  // Whether Run() may pick the item with the given level of the tripod at the current node,
+  // where the library has the tripod at level `stored`.
+  bool MayPick(uint32_t item, uint8_t level, uint8_t stored) const {
+    return !used[item] && !banned[item] && book[instance.rows[item]] && level > stored &&
+           (instance.twin[item] < 0 || used[instance.twin[item]]);
+  }
+
+  // Keeps the item out of the subtree of the current node.
+  void Ban(uint32_t item) {
+    ++banned[item];
+    bans.push_back({item, scores.size() - 1});
+  }
+
+  // Keeps the item out of the rest of the search.
+  void Exclude(uint32_t item) { ++banned[item]; }
+
+  // Items that Exclude() keeps out of the search.
+  vector<uint32_t> Excluded() const {
+    vector<uint16_t> n = banned;
+    for (auto [j, node] : bans) --n[j];
+    vector<uint32_t> res;
+    for (uint32_t j = 0; j != n.size(); ++j) res.insert(res.end(), n[j], j);
+    return res;
+  }
+
+  // Makes Run() skip the rest of the subtree of the node at the given depth, that is the node
+  // that picked the item at assignments[depth - 1]. Depth zero is the root, so it ends the
+  // search. Must be called from visit().
+  void Backjump(size_t depth) { keep = depth; }
+
+  // Indices of the used items in ascending order.
+  vector<uint32_t> Used() const {
+    vector<uint32_t> res;
+    for (uint32_t i = 0; i != used.size(); ++i) {
+      if (used[i]) res.push_back(i);
+    }
+    return res;
+  }
+
+  // The number of tripods to pick items for after reaching score `s`.
+  size_t DepthLimit(const Score& s) const {
+    // This is an optimization that works only if there is a solution that obtains
+    // all high-priority tripods. If Optimize() doesn't find a solution, try removing
+    // this branch.
+    return instance.HasAllPrio(s) ? instance.candidates.size() : instance.prio_depth;
+  }
+
+  static constexpr size_t kNone = -1;
+
+  const Instance& instance;
+  // The number of free slots in every row.
+  Book book;
+  const size_t floor;
+  vector<bool> used;
+  // Run() doesn't pick items with bans. bans has the items banned by Ban() and the depth of the
+  // node that banned each of them.
+  vector<uint16_t> banned;
+  vector<pair<uint32_t, size_t>> bans;
+  // They see every pick and unpick of Run().
+  vector<Tracker*> trackers;
+  // assignments[d] is the position in candidates[d] of the item picked for tripod order[d], or
+  // kNone. scores.back() is the score of all used items. If forced items don't fit, scores is
+  // empty and Run() visits nothing.
+  vector<size_t> assignments;
+  vector<Score> scores;
+  // The number of levels of assignments that Backjump() keeps, or kNone.
+  size_t keep = kNone;
+  bool pause = false;
+  // The number of nodes that Run() has visited.
+  uint64_t nodes = 0;
+
+ private:
+  // Picks the item at a new node.
+  void Pick(uint32_t item) {
+    used[item] = true;
+    --book[instance.rows[item]];
+    scores.push_back(scores.back());
+    instance.Add(scores.back(), item);
+    for (Tracker* t : trackers) t->Pick(item, scores.end()[-2], scores.back());
+  }
+
+  // Goes to every node on the current path, the root first, and calls f(children) there with
+  // the children of the node that Run() has yet to visit as (depth, item). f() must leave the
+  // search at the node. Leaves the search at the current node.
+  template <class F>
+  void ForPendingChildren(F&& f) {
+    vector<pair<size_t, size_t>> path;
+    for (size_t d = 0; d != assignments.size(); ++d) {
+      if (assignments[d] != kNone) path.push_back({d, assignments[d]});
+    }
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      Unpick(instance.candidates[it->first][it->second]);
+    }
+
+    vector<pair<size_t, uint32_t>> children;
+    for (size_t k = 0, from = floor;; ++k) {
+      // Children of the k-th node of the path that come after its child on the path.
+      children.clear();
+      if (k != path.size()) {
+        auto [d, a] = path[k];
+        auto [c, i] = instance.order_places[d];
+        const uint8_t stored = Lane(scores.back().tripods, c, i);
+        for (size_t b = a + 1; b != instance.candidates[d].size(); ++b) {
+          uint32_t j = instance.candidates[d][b];
+          if (MayPick(j, instance.candidate_levels[d][b], stored)) children.push_back({d, j});
+        }
+      }
+      Children(from, k == path.size() ? assignments.size() : path[k].first, children);
+      f(children);
+      if (k == path.size()) return;
+      Pick(instance.candidates[path[k].first][path[k].second]);
+      from = path[k].first + 1;
+    }
+  }
+
+  // A random walk of Estimate() from the current node, which picked an item for
+  // order[from - 1]. Leaves the search at the current node.
+  double Probe(size_t from, const Score& best, mt19937_64& rng) {
+    double res = 1, width = 1;
+    vector<uint32_t> walk;
+    vector<pair<size_t, uint32_t>> children;
+    while (instance.MayImprove(scores.back(), book, best)) {
+      children.clear();
+      Children(from, DepthLimit(scores.back()), children);
+      if (children.empty()) break;
+      auto [d, j] = children[rng() % children.size()];
+      width *= children.size();
+      res += width;
+      Pick(j);
+      walk.push_back(j);
+      from = d + 1;
+    }
+    for (; !walk.empty(); walk.pop_back()) Unpick(walk.back());
+    return res;
+  }
+
+  // Undoes the pick of the item at the current node.
+  void Unpick(uint32_t item) {
+    for (size_t node = scores.size() - 1; !bans.empty() && bans.back().second >= node;) {
+      --banned[bans.back().first];
+      bans.pop_back();
+    }
+    for (Tracker* t : trackers) t->Unpick(item, scores.end()[-2], scores.back());
+    used[item] = false;
+    ++book[instance.rows[item]];
+    scores.pop_back();
+  }
+};
+
+// Bounds solutions in the subtree of the current node of `search` with the LP relaxation, where
+// items may be used fractionally. Like Instance::MayImprove(), it bounds tiers one by one, each
+// with its own LP, and returns false if no solution in the subtree can beat `best`.
+//
+// The reduced costs of the LP bound it with any single item forced in. Items that can't lead to a
+// solution better than `best` get banned from the subtree.
+bool LpMayImprove(Search& search, const Score& s, const Score& best) {
+  const Instance& instance = search.instance;
+  for (uint8_t k = 0; k != instance.tiers; ++k) {
+    // Variables are the items that gain something in this tier, then the units they may gain:
+    // unit[c][i][l] is reaching level l of tripod i of class c. Every unit is capped by the sum
+    // of the items that have the tripod at this level or higher.
+    vector<uint32_t> items;
+    vector<vector<int16_t>> covers;
+    vector<int32_t> weights;
+    array<array<array<int16_t, kMaxLevel + 1>, 64>, kMaxClasses> unit;
+    for (auto& x : unit) {
+      for (auto& y : x) y.fill(-1);
+    }
+    for (uint32_t j = 0; j != instance.size(); ++j) {
+      if (search.used[j] || search.banned[j] || !search.book[instance.rows[j]]) continue;
+      vector<int16_t> cover;
+      for (uint8_t c = 0; c != instance.classes.size(); ++c) {
+        for (uint8_t w = 0; w != kClassWords; ++w) {
+          size_t x = c * kClassWords + w;
+          uint64_t g = (LaneMax(instance.tripods[j][x], s.tripods[x]) - s.tripods[x]) &
+                       instance.tier_lanes[c][k][w];
+          for (uint64_t m = NonZeroLanes(g); m; m &= m - 1) {
+            int lane = countr_zero(m);
+            uint8_t i = w * 16 + lane / 4;
+            int from = s.tripods[x] >> lane & 15, to = instance.tripods[j][x] >> lane & 15;
+            for (int l = from + 1; l <= to; ++l) {
+              int16_t& u = unit[c][i][l];
+              if (u < 0) {
+                u = weights.size();
+                weights.push_back(instance.weight_of[c][i]);
+              }
+              cover.push_back(u);
+            }
+          }
+        }
+      }
+      if (cover.empty()) continue;
+      items.push_back(j);
+      covers.push_back(move(cover));
+    }
+
+    const size_t n = items.size(), vars = n + weights.size();
+    Simplex lp;
+    lp.a.assign(kRows + weights.size(), vector<double>(vars));
+    lp.b.assign(kRows + weights.size(), 0);
+    lp.obj.assign(vars, 0);
+    lp.upper.assign(vars, 1);
+    for (uint8_t r = 0; r != kRows; ++r) lp.b[r] = search.book[r];
+    for (size_t j = 0; j != n; ++j) {
+      lp.a[instance.rows[items[j]]][j] = 1;
+      for (int16_t u : covers[j]) lp.a[kRows + u][j] = -1;
+    }
+    for (size_t u = 0; u != weights.size(); ++u) {
+      lp.a[kRows + u][n + u] = 1;
+      lp.obj[n + u] = weights[u];
+    }
+    if (!lp.Solve()) return true;
+
+    auto bound = [&](double v) { return s.tiers[k] + int32_t(floor(v + 1e-6)); };
+    if (bound(lp.value) < best.tiers[k]) return false;
+    for (size_t j = 0; j != n; ++j) {
+      if (bound(lp.value + lp.reduced[j]) < best.tiers[k]) search.Ban(items[j]);
+    }
+    if (bound(lp.value) > best.tiers[k]) return true;
+  }
+  if (s.cost != best.cost) return s.cost < best.cost;
+  return s.moves < best.moves;
+}
+
+// Lagrangian relaxation of the row capacities and of the links between items and the tripod
+// levels they reach. Without them, every row, item and level is bounded on its own. For a tier:
+//
+//   bound = sum over rows with free slots of (lambda[r] * free[r] + sum of max(0, profit[j]))
+//         + sum over unreached levels u of max(0, weight[u] - mu[u])
+//
+// where j goes over the unused items of the row, and profit[j] is the sum of mu[u] over the
+// unreached levels of item j minus lambda of its row. Any non-negative multipliers give a valid
+// bound. Subgradient optimization picks them at the root, and the bound follows the search
+// incrementally. Multipliers are fixed-point so that unpicking an item restores the sums exactly.
+class Lagrangian : public Tracker {
+ public:
+  // The search must be at its root.
+  Lagrangian(Search& search, const Score& best) : search(search), instance(search.instance) {
+    if (search.scores.empty()) return;
+    const Score& root = search.scores.back();
+    tiers.resize(instance.tiers);
+    for (uint8_t k = 0; k != instance.tiers; ++k) {
+      Tier& tier = tiers[k];
+      tier.unit_items.resize(instance.units());
+      tier.mu.assign(tier.unit_items.size(), 0);
+      tier.profit.assign(instance.size(), 0);
+      vector<vector<uint32_t>> item_units(instance.size());
+      for (uint32_t j = 0; j != instance.size(); ++j) {
+        if (search.used[j] || !search.book[instance.rows[j]]) continue;
+        Levels reach = root.tripods;
+        for (size_t x = 0; x != reach.size(); ++x) {
+          reach[x] = LaneMax(reach[x], instance.tripods[j][x]);
+        }
+        instance.ForUnits(k, root.tripods, reach, [&](uint32_t u) {
+          tier.unit_items[u].push_back(j);
+          item_units[j].push_back(u);
+        });
+      }
+      Subgradient(k, item_units, max(0, best.tiers[k] - root.tiers[k]));
+
+      for (size_t u = 0; u != tier.unit_items.size(); ++u) {
+        if (tier.unit_items[u].empty()) continue;
+        tier.open += max<int64_t>(0, instance.UnitWeight(u) * kScale - tier.mu[u]);
+      }
+      for (uint32_t j = 0; j != instance.size(); ++j) {
+        if (search.used[j]) continue;
+        tier.profit[j] = -tier.lambda[instance.rows[j]];
+        for (uint32_t u : item_units[j]) tier.profit[j] += tier.mu[u];
+        tier.rows[instance.rows[j]] += max<int64_t>(0, tier.profit[j]);
+      }
+      tier.root_profit = tier.profit;
+      tier.root = Scaled(tier, search.book);
+    }
+    root_score = root;
+    root_book = search.book;
+    excluded = search.used;
+  }
+
+  // Returns false if no solution extending `s` can beat `best`. `s` must be the score of the
+  // current node of the search.
+  bool MayImprove(const Score& s, const Score& best) const {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      int32_t bound = s.tiers[k] + Bound(tiers[k], search.book);
+      if (bound != best.tiers[k]) return bound > best.tiers[k];
+    }
+    if (s.cost != best.cost) return s.cost < best.cost;
+    return s.moves < best.moves;
+  }
+
+  // Excludes from the search all items that can't be in a solution better than `best`: the root
+  // bound with such an item forced in loses to `best`.
+  void Fix(const Score& best) {
+    for (uint32_t j = 0; j != excluded.size(); ++j) {
+      if (excluded[j] || !root_book[instance.rows[j]]) continue;
+      for (uint8_t k = 0; k != tiers.size(); ++k) {
+        const Tier& tier = tiers[k];
+        int32_t bound =
+            root_score.tiers[k] + Floor(tier.root + min<int64_t>(0, tier.root_profit[j]));
+        if (bound > best.tiers[k]) break;
+        if (bound < best.tiers[k]) {
+          excluded[j] = true;
+          search.Exclude(j);
+          break;
+        }
+      }
+    }
+  }
+
+  void Pick(uint32_t item, const Score& before, const Score& after) override {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      Tier& tier = tiers[k];
+      tier.rows[instance.rows[item]] -= max<int64_t>(0, tier.profit[item]);
+      instance.ForUnits(k, before.tripods, after.tripods, [&](uint32_t u) { Reach(tier, u, -1); });
+    }
+  }
+
+  void Unpick(uint32_t item, const Score& before, const Score& after) override {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      Tier& tier = tiers[k];
+      instance.ForUnits(k, before.tripods, after.tripods, [&](uint32_t u) { Reach(tier, u, 1); });
+      tier.rows[instance.rows[item]] += max<int64_t>(0, tier.profit[item]);
+    }
+  }
+
+ private:
+  // Multipliers are in units of 1/kScale of a weight.
+  static constexpr int64_t kScale = 1 << 16;
+
+  struct Tier {
+    // Multipliers, and the items that reach every unit (see Instance::units()) from the root.
+    // Units without items don't count.
+    array<int64_t, kRows> lambda = {};
+    vector<int64_t> mu;
+    vector<vector<uint32_t>> unit_items;
+    // Parts of the bound at the current node: profit of every item, the sum of positive profits
+    // of unused items in every row, and the sum over unreached units.
+    vector<int64_t> profit;
+    array<int64_t, kRows> rows = {};
+    int64_t open = 0;
+    // The bound and the item profits at the root.
+    int64_t root = 0;
+    vector<int64_t> root_profit;
+  };
+
+  static int32_t Floor(int64_t x) { return x / kScale; }
+
+  int32_t Bound(const Tier& tier, const Book& book) const { return Floor(Scaled(tier, book)); }
+
+  int64_t Scaled(const Tier& tier, const Book& book) const {
+    int64_t res = tier.open;
+    for (uint8_t r = 0; r != kRows; ++r) {
+      if (book[r]) res += tier.lambda[r] * book[r] + tier.rows[r];
+    }
+    return res;
+  }
+
+  // Marks unit u as reached (sign -1) or unreached (sign 1).
+  void Reach(Tier& tier, uint32_t u, int sign) {
+    if (tier.unit_items[u].empty()) return;
+    tier.open += sign * max<int64_t>(0, instance.UnitWeight(u) * kScale - tier.mu[u]);
+    for (uint32_t j : tier.unit_items[u]) {
+      if (!search.used[j]) tier.rows[instance.rows[j]] -= max<int64_t>(0, tier.profit[j]);
+      tier.profit[j] += sign * tier.mu[u];
+      if (!search.used[j]) tier.rows[instance.rows[j]] += max<int64_t>(0, tier.profit[j]);
+    }
+  }
+
+  // Sets the multipliers of tier k to make the root bound small. It's enough for the bound to
+  // get down to `target`.
+  void Subgradient(uint8_t k, const vector<vector<uint32_t>>& item_units, int32_t target) {
+    Tier& tier = tiers[k];
+    const size_t units = tier.unit_items.size();
+    vector<double> mu(units), lambda(kRows), g_mu(units), g_lambda(kRows);
+    for (size_t u = 0; u != units; ++u) mu[u] = instance.UnitWeight(u);
+    double best = numeric_limits<double>::infinity(), theta = 2;
+    for (int iter = 0, stale = 0; iter != 200; ++iter) {
+      double bound = 0;
+      fill(g_mu.begin(), g_mu.end(), 0);
+      for (size_t u = 0; u != units; ++u) {
+        if (tier.unit_items[u].empty() || instance.UnitWeight(u) <= mu[u]) continue;
+        bound += instance.UnitWeight(u) - mu[u];
+        g_mu[u] = -1;
+      }
+      for (uint8_t r = 0; r != kRows; ++r) {
+        bound += lambda[r] * search.book[r];
+        g_lambda[r] = search.book[r];
+      }
+      for (uint32_t j = 0; j != item_units.size(); ++j) {
+        if (item_units[j].empty()) continue;
+        double profit = -lambda[instance.rows[j]];
+        for (uint32_t u : item_units[j]) profit += mu[u];
+        if (profit <= 0) continue;
+        bound += profit;
+        --g_lambda[instance.rows[j]];
+        for (uint32_t u : item_units[j]) ++g_mu[u];
+      }
+      if (bound < best - 1e-9) {
+        best = bound;
+        stale = 0;
+        for (size_t u = 0; u != units; ++u) tier.mu[u] = llround(mu[u] * kScale);
+        for (uint8_t r = 0; r != kRows; ++r) tier.lambda[r] = llround(lambda[r] * kScale);
+      } else if (++stale == 10) {
+        theta /= 2;
+        stale = 0;
+      }
+      if (bound < target + 1) break;
+      double norm = 0;
+      for (double x : g_mu) norm += x * x;
+      for (uint8_t r = 0; r != kRows; ++r) {
+        if (search.book[r]) norm += g_lambda[r] * g_lambda[r];
+      }
+      if (!norm) break;
+      double step = theta * (bound - target) / norm;
+      for (size_t u = 0; u != units; ++u) {
+        mu[u] = clamp(mu[u] - step * g_mu[u], 0.0, double(instance.UnitWeight(u)));
+      }
+      for (uint8_t r = 0; r != kRows; ++r) lambda[r] = max(0.0, lambda[r] - step * g_lambda[r]);
+    }
+  }
+
+  Search& search;
+  const Instance& instance;
+  vector<Tier> tiers;
+  Score root_score;
+  Book root_book;
+  // Items that are used at the root or excluded by Fix().
+  vector<bool> excluded;
+};
+
+// Bounds every tier: a row can add no more than the largest marginal gains of as many of its
+// unused items as it has free slots. Gains only shrink as items get picked. Every row keeps its
+// items in buckets by gain, so the bound takes a few steps per row.
+class TopGains : public Tracker {
+ public:
+  // The search must be at its root.
+  explicit TopGains(const Search& search) : search(search), instance(search.instance) {
+    if (search.scores.empty()) return;
+    const Levels& root = search.scores.back().tripods;
+    tiers.resize(instance.tiers);
+    for (uint8_t k = 0; k != instance.tiers; ++k) {
+      Tier& tier = tiers[k];
+      tier.unit_items.resize(instance.units());
+      tier.gain.assign(instance.size(), 0);
+      tier.tracked.assign(instance.size(), false);
+      for (uint32_t j = 0; j != instance.size(); ++j) {
+        uint8_t r = instance.rows[j];
+        if (search.used[j] || !search.book[r]) continue;
+        Levels reach = root;
+        for (size_t x = 0; x != reach.size(); ++x) {
+          reach[x] = LaneMax(reach[x], instance.tripods[j][x]);
+        }
+        instance.ForUnits(k, root, reach, [&](uint32_t u) {
+          tier.unit_items[u].push_back(j);
+          tier.gain[j] += instance.UnitWeight(u);
+        });
+        if (!tier.gain[j]) continue;
+        tier.tracked[j] = true;
+        vector<int32_t>& b = tier.buckets[r];
+        if (b.size() <= size_t(tier.gain[j])) b.resize(tier.gain[j] + 1);
+        Insert(tier, j);
+      }
+    }
+  }
+
+  // Returns false if no solution extending `s` can beat `best`.
+  bool MayImprove(const Score& s, const Book& book, const Score& best) const {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      const Tier& tier = tiers[k];
+      int32_t bound = s.tiers[k];
+      for (uint8_t r = 0; r != kRows; ++r) {
+        for (int32_t g = tier.top[r], n = book[r]; g > 0 && n; --g) {
+          int32_t m = min(n, tier.buckets[r][g]);
+          bound += m * g;
+          n -= m;
+        }
+      }
+      if (bound != best.tiers[k]) return bound > best.tiers[k];
+    }
+    return true;
+  }
+
+  void Pick(uint32_t item, const Score& before, const Score& after) override {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      Tier& tier = tiers[k];
+      if (!tier.gain[item]) continue;
+      Erase(tier, item);
+      instance.ForUnits(k, before.tripods, after.tripods, [&](uint32_t u) {
+        for (uint32_t j : tier.unit_items[u]) Change(tier, j, -instance.UnitWeight(u));
+      });
+    }
+  }
+
+  void Unpick(uint32_t item, const Score& before, const Score& after) override {
+    for (uint8_t k = 0; k != tiers.size(); ++k) {
+      Tier& tier = tiers[k];
+      if (!tier.tracked[item]) continue;
+      instance.ForUnits(k, before.tripods, after.tripods, [&](uint32_t u) {
+        for (uint32_t j : tier.unit_items[u]) Change(tier, j, instance.UnitWeight(u));
+      });
+      if (tier.gain[item]) Insert(tier, item);
+    }
+  }
+
+ private:
+  struct Tier {
+    // The items that reach every unit (see Instance::units()) of the tier from the root.
+    vector<vector<uint32_t>> unit_items;
+    // The marginal gain of every item, and whether it had any at the root. Other items never
+    // gain anything.
+    vector<int32_t> gain;
+    vector<bool> tracked;
+    // buckets[r][g] is the number of unused items in row r with gain g. top[r] is the largest g
+    // with items, or zero.
+    array<vector<int32_t>, kRows> buckets;
+    array<int32_t, kRows> top = {};
+  };
+
+  void Insert(Tier& tier, uint32_t j) {
+    uint8_t r = instance.rows[j];
+    ++tier.buckets[r][tier.gain[j]];
+    tier.top[r] = max(tier.top[r], tier.gain[j]);
+  }
+
+  void Erase(Tier& tier, uint32_t j) {
+    uint8_t r = instance.rows[j];
+    --tier.buckets[r][tier.gain[j]];
+    while (tier.top[r] && !tier.buckets[r][tier.top[r]]) --tier.top[r];
+  }
+
+  void Change(Tier& tier, uint32_t j, int32_t delta) {
+    if (search.used[j]) {
+      tier.gain[j] += delta;
+      return;
+    }
+    Erase(tier, j);
+    tier.gain[j] += delta;
+    Insert(tier, j);
+  }
+
+  const Search& search;
+  const Instance& instance;
+  vector<Tier> tiers;
+};
+
+// Nogoods: sets of items that no solution better than the incumbent contains. A typical one is
+// the items that fill up a few rows, leaving some high-priority tripods out of reach. So when a
+// node fails Instance::MayImprove(), Optimize() checks whether its picks in full rows alone fail
+// the bound too, drops rows from that set one by one while the bound still fails, and learns what
+// is left. A nogood stays valid as the incumbent improves.
+//
+// The search backjumps to the deepest node that picked an item of a new nogood. Every nogood
+// watches two of its items. Once all but one of its items are picked, the last one gets banned.
+// Once all of them are picked, the node fails.
+class Nogoods : public Tracker {
+ public:
+  explicit Nogoods(Search& search)
+      : search(search), instance(search.instance), watches(instance.size()) {}
+
+  // Learns a nogood at the current node of the search, which can't beat `best`.
+  void Learn(const Score& best) {
+    // Most failures have no short nogood. Every attempt that finds none halves how often
+    // Learn() tries.
+    if (++failures < interval) return;
+    failures = 0;
+    interval = min(interval * 2, kMaxInterval);
+    // Picks on the path to the node as (item, depth), and free slots at the root.
+    vector<pair<uint32_t, size_t>> picks;
+    Book root = search.book;
+    for (size_t d = 0; d != search.assignments.size(); ++d) {
+      if (search.assignments[d] == Search::kNone) continue;
+      uint32_t j = instance.candidates[d][search.assignments[d]];
+      picks.push_back({j, d});
+      ++root[instance.rows[j]];
+    }
+    // Whether the picks in the rows from bitmask m fail the bound.
+    auto fails = [&](uint8_t m) {
+      Score s = search.scores.front();
+      Book book = root;
+      for (auto [j, d] : picks) {
+        if (!(m >> instance.rows[j] & 1)) continue;
+        instance.Add(s, j);
+        --book[instance.rows[j]];
+      }
+      return !instance.MayImprove(s, book, best);
+    };
+    uint8_t rows = 0;
+    for (uint8_t r = 0; r != kRows; ++r) rows |= !search.book[r] << r;
+    if (!fails(rows)) return;
+    for (uint8_t r = 0; r != kRows; ++r) {
+      if (rows >> r & 1 && fails(rows & ~(1 << r))) rows &= ~(1 << r);
+    }
+    erase_if(picks, [&](auto p) { return !(rows >> instance.rows[p.first] & 1); });
+    if (picks.size() > kMaxLength) return;
+    interval = 1;
+
+    if (picks.empty()) return search.Backjump(0);
+    search.Backjump(picks.back().second + 1);
+    if (picks.size() == 1) return search.Exclude(picks[0].first);
+    if (clauses.size() == kMaxClauses) Reduce();
+    vector<uint32_t>& c = clauses.emplace_back();
+    // The deepest two items go first and get watched.
+    for (auto it = picks.rbegin(); it != picks.rend(); ++it) c.push_back(it->first);
+    watches[c[0]].push_back(clauses.size() - 1);
+    watches[c[1]].push_back(clauses.size() - 1);
+  }
+
+  void Pick(uint32_t item, const Score&, const Score&) override {
+    vector<uint32_t>& w = watches[item];
+    for (size_t k = 0; k != w.size();) {
+      vector<uint32_t>& c = clauses[w[k]];
+      if (c[0] == item) swap(c[0], c[1]);
+      auto it = find_if(c.begin() + 2, c.end(), [&](uint32_t j) { return !search.used[j]; });
+      if (it != c.end()) {
+        swap(c[1], *it);
+        watches[c[1]].push_back(w[k]);
+        w[k] = w.back();
+        w.pop_back();
+        continue;
+      }
+      if (search.used[c[0]]) {
+        conflict = true;
+      } else {
+        search.Ban(c[0]);
+      }
+      ++k;
+    }
+  }
+
+  void Unpick(uint32_t, const Score&, const Score&) override {}
+
+  // Items that no solution better than the incumbent uses together. They don't depend on the
+  // order of the search, so another search of the same tree can Import() them.
+  const vector<vector<uint32_t>>& Clauses() const { return clauses; }
+
+  // Adds nogoods that hold for the tree of the search. The search must be at its root.
+  void Import(const vector<vector<uint32_t>>& nogoods) {
+    for (const vector<uint32_t>& c : nogoods) {
+      if (clauses.size() == kMaxClauses) break;
+      clauses.push_back(c);
+    }
+    Watch();
+  }
+
+  // Whether the last pick completed a nogood. The caller resets it.
+  bool conflict = false;
+
+ private:
+  static constexpr size_t kMaxClauses = 1 << 14;
+  static constexpr size_t kMaxLength = 16;
+  static constexpr uint32_t kMaxInterval = 1 << 12;
+
+  // Forgets the older half of the nogoods.
+  void Reduce() {
+    clauses.erase(clauses.begin(), clauses.begin() + clauses.size() / 2);
+    Watch();
+  }
+
+  // Sets up the watches of all nogoods from scratch.
+  void Watch() {
+    for (vector<uint32_t>& w : watches) w.clear();
+    for (uint32_t k = 0; k != clauses.size(); ++k) {
+      vector<uint32_t>& c = clauses[k];
+      // Prefer unused items for the watches.
+      stable_partition(c.begin(), c.end(), [&](uint32_t j) { return !search.used[j]; });
+      watches[c[0]].push_back(k);
+      watches[c[1]].push_back(k);
+    }
+  }
+
+  Search& search;
+  const Instance& instance;
+  // Learn() tries to learn a nogood once in `interval` failures.
+  uint32_t interval = 1;
+  uint32_t failures = 0;
+  vector<vector<uint32_t>> clauses;
+  // watches[j] has the indices of the nogoods that watch item j.
+  vector<vector<uint32_t>> watches;
+};
+
+// Prints the title, the score of the solution, the levels of all tripods and the items it uses.
+void Print(ostream& out, const Instance& instance, string_view title, const Solution& solution) {
+  out << "==[ " << title << ": " << instance.Format(solution.score);
+  for (size_t c = 0; c != instance.classes.size(); ++c) {
+    out << ' ' << instance.FormatLevels(solution.score, c);
+  }
+  out << " ]==\n";
+  for (uint32_t i : solution.items) out << "Use item: #" << setfill('0') << setw(2) << i << "\n";
+  out << flush;
+}
+
+// The state of a paused search, which Optimize() saves to a file now and then to resume the
+// search after a crash.
+struct Checkpoint {
+  // Writes the checkpoint to a new file and renames it to `path`, so that a crash in the middle
+  // leaves the old checkpoint intact.
+  void Save(const string& path) const {
+    string tmp = path + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      auto put = [&](const auto& v) {
+        uint64_t n = v.size();
+        out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+        out.write(reinterpret_cast<const char*>(v.data()), n * sizeof(v[0]));
+      };
+      out.write(kMagic, sizeof(kMagic));
+      out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+      out.write(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+      out.write(reinterpret_cast<const char*>(&nodes), sizeof(nodes));
+      out.write(reinterpret_cast<const char*>(&best.score), sizeof(best.score));
+      put(best.items);
+      put(assignments);
+      put(excluded);
+      if (!out.flush()) throw runtime_error("cannot write " + tmp);
+    }
+    if (rename(tmp.c_str(), path.c_str())) throw runtime_error("cannot write " + path);
+  }
+
+  // Reads the checkpoint from `path`. Returns false if there is no such file.
+  bool Load(const string& path) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    auto get = [&](auto& v) {
+      uint64_t n = 0;
+      in.read(reinterpret_cast<char*>(&n), sizeof(n));
+      if (!in || n > (1 << 24)) throw runtime_error("bad checkpoint " + path);
+      v.resize(n);
+      in.read(reinterpret_cast<char*>(v.data()), n * sizeof(v[0]));
+    };
+    char magic[sizeof(kMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || !equal(magic, magic + sizeof(magic), kMagic)) {
+      throw runtime_error("bad checkpoint " + path);
+    }
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    in.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint));
+    in.read(reinterpret_cast<char*>(&nodes), sizeof(nodes));
+    in.read(reinterpret_cast<char*>(&best.score), sizeof(best.score));
+    get(best.items);
+    get(assignments);
+    get(excluded);
+    if (!in) throw runtime_error("bad checkpoint " + path);
+    return true;
+  }
+
+  static constexpr char kMagic[8] = {'l', 'a', 't', 'r', 'i', 'p', 'c', '2'};
+
+  // The number of items in the instance and its Instance::Fingerprint().
+  uint64_t size = 0;
+  uint64_t fingerprint = 0;
+  uint64_t nodes = 0;
+  Solution best;
+  vector<size_t> assignments;
+  vector<uint32_t> excluded;
+};
+
+// Optimal solutions on disk, one file per instance in a directory. Instances that differ only in
+// the order of their items, in the ids of their tripods or in items without tripods of any class
+// share their file, which is named after a hash of the canonical form of the instance.
+struct SolutionCache {
+  // Returns the cached optimal solution of the instance, if any.
+  optional<Solution> Find(const Instance& instance) const {
+    auto [key, order] = Canonical(instance);
+    ifstream in(Path(key), ios::binary);
+    if (!in) return nullopt;
+    auto get = [&](auto& v) {
+      uint64_t n = 0;
+      in.read(reinterpret_cast<char*>(&n), sizeof(n));
+      if (!in || n > (1 << 24)) return false;
+      v.resize(n);
+      return bool(in.read(reinterpret_cast<char*>(v.data()), n * sizeof(v[0])));
+    };
+    char magic[sizeof(kMagic)];
+    string stored;
+    vector<uint32_t> items;
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), kMagic) ||
+        !get(stored) || stored != key || !get(items)) {
+      return nullopt;
+    }
+    Solution res;
+    for (uint32_t i : items) {
+      if (i >= order.size()) return nullopt;
+      res.items.push_back(order[i]);
+    }
+    sort(res.items.begin(), res.items.end());
+    for (uint32_t i : res.items) instance.Add(res.score, i);
+    return res;
+  }
 
-#include <array>
-#include <bit>
-#include <bitset>
-#include <cstdint>
-#include <iomanip>
-#include <iostream>
-#include <stack>
-#include <tuple>
-#include <vector>
+  // Stores the optimal solution of the instance. The file gets written under a temporary name
+  // and renamed, so readers see either no entry or a complete one.
+  void Store(const Instance& instance, const Solution& solution) const {
+    auto [key, order] = Canonical(instance);
+    vector<uint32_t> index(instance.size(), -1), items;
+    for (uint32_t i = 0; i != order.size(); ++i) index[order[i]] = i;
+    for (uint32_t j : solution.items) {
+      if (index[j] == uint32_t(-1)) throw runtime_error("solution uses an item without tripods");
+      items.push_back(index[j]);
+    }
+    sort(items.begin(), items.end());
+    string path = Path(key), tmp = path + "." + to_string(getpid()) + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      auto put = [&](const auto& v) {
+        uint64_t n = v.size();
+        out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+        out.write(reinterpret_cast<const char*>(v.data()), n * sizeof(v[0]));
+      };
+      out.write(kMagic, sizeof(kMagic));
+      put(key);
+      put(items);
+      if (!out.flush()) throw runtime_error("cannot write " + tmp);
+    }
+    if (rename(tmp.c_str(), path.c_str())) throw runtime_error("cannot write " + path);
+  }
 
-namespace {
+  static constexpr char kMagic[8] = {'l', 'a', 't', 'r', 'i', 'p', 's', '1'};
 
-using namespace std;
+  string dir;
 
-// Each page has this many rows: helmet, shoulders, etc.
-constexpr uint8_t kRows = 6;
-// Each item can have up to this many tripods.
-constexpr uint8_t kTripods = 3;
+ private:
+  // The canonical form of the instance, and the items it lists in order. It has what the score
+  // depends on: the book, the tier and weight of every tripod of every class, whether moves
+  // count, how many items every row of the library has now, and the items with tripods of some
+  // class sorted by row, cost, whether they are in the library and their levels, which Instance
+  // keeps by class and lane instead of tripod id. Items without such tripods never get picked,
+  // but the ones in the library still take slots, so they count through the rows.
+  static pair<string, vector<uint32_t>> Canonical(const Instance& instance) {
+    vector<uint32_t> order;
+    for (uint32_t i = 0; i != instance.size(); ++i) {
+      const Levels& v = instance.tripods[i];
+      if (any_of(v.begin(), v.end(), [](uint64_t w) { return w; })) order.push_back(i);
+    }
+    auto key = [&](uint32_t i) {
+      return tie(instance.rows[i], instance.costs[i], instance.tripods[i]);
+    };
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      if (key(a) != key(b)) return key(a) < key(b);
+      return instance.placed[a] < instance.placed[b];
+    });
+    string res;
+    auto put = [&](const auto& x) {
+      res.append(reinterpret_cast<const char*>(&x), sizeof(x));
+    };
+    put(instance.book);
+    put(instance.tiers);
+    put(uint8_t(instance.classes.size()));
+    for (uint8_t c = 0; c != instance.classes.size(); ++c) {
+      put(instance.tier_of[c]);
+      put(instance.weight_of[c]);
+    }
+    put(instance.track_moves);
+    put(instance.placed_in_row);
+    for (uint32_t i : order) {
+      put(instance.rows[i]);
+      put(instance.costs[i]);
+      put(bool(instance.placed[i]));
+      put(instance.tripods[i]);
+    }
+    return {res, order};
+  }
 
-using Book = array<uint8_t, kRows>;
+  // The file of an instance with the given canonical form: its 64-bit FNV-1a hash in hex.
+  string Path(const string& key) const {
+    ostringstream name;
+    name << dir << '/' << hex << setfill('0') << setw(16) << Fnv1a(key) << ".sol";
+    return name.str();
+  }
+};
 
-struct Item {
-  // The row this item goes to (helmet, shoulders, etc.). In [0, kRows).
-  const uint8_t row;
-  // How much gold it costs to use this item.
-  const uint16_t cost;
-  // Tripods that this item provides.
-  const uint8_t tripods[kTripods];
+// Set by the signal handler: SIGINT and SIGTERM stop the searches of Optimize(), and SIGUSR1
+// makes one of them print its stats to stderr.
+atomic<bool> stop_requested = false, stats_requested = false;
+static_assert(atomic<bool>::is_always_lock_free);
+
+void OnSignal(int sig) { (sig == SIGUSR1 ? stats_requested : stop_requested) = true; }
+
+// The incumbent that several searches share. Each search takes the solutions that the others
+// found and stops once one of them is done.
+struct SharedBest {
+  // Takes the solution if it's better than the shared one.
+  void Offer(const Solution& s) {
+    lock_guard lock(mutex);
+    if (!s.score.BetterThan(best.score)) return;
+    best = s;
+    ++version;
+    if (log) Print(*log, instance, "New best assignment", best);
+  }
 
-  // Whether the item should be used. This field gets set by the optimizer.
-  bool used = false;
+  // Replaces `s` with the shared solution if it's better. `seen` is the version of the shared
+  // solution that the caller has seen, so the call is cheap if nothing changed since then.
+  bool Take(Solution& s, uint64_t& seen) {
+    if (version == seen) return false;
+    lock_guard lock(mutex);
+    seen = version;
+    if (!best.score.BetterThan(s.score)) return false;
+    s = best;
+    return true;
+  }
+
+  const Instance& instance;
+  // If it isn't null, every new best solution gets printed to it.
+  ostream* log;
+  std::mutex mutex;
+  Solution best;
+  atomic<uint64_t> version = 0;
+  atomic<bool> done = false;
 };
 
-struct Score {
-  bool BetterThan(const Score& other, uint64_t prio_mask) const {
-    auto score = [&](const Score& x) {
-      return make_tuple(x.tripod_count(prio_mask), x.tripod_count(), -x.cost);
+// What one run of a restarted search passes to the next one.
+struct Restart {
+  // The run stops after this many nodes.
+  uint64_t nodes = 0;
+  // Whether the run finished its search, so the incumbent is optimal.
+  bool done = false;
+  // What the runs have learned so far, see Search::Excluded() and Nogoods::Clauses().
+  vector<uint32_t> excluded;
+  vector<vector<uint32_t>> nogoods;
+};
+
+// Finds the best solution in the search tree of `search` that is better than the incumbent. If
+// there is no such solution, returns the incumbent. If `log` isn't null, every new best solution
+// gets printed to it.
+//
+// On stop_requested, returns the best solution so far. If `log` isn't null, it also gets the
+// solution and a bound that no solution in the search tree can beat in any tier.
+//
+// If `checkpoint` isn't empty, the search resumes from this file if it exists and saves its
+// state there every `period`. The file is removed once the search is over.
+//
+// If `shared` isn't null, the search shares its incumbent with other searches and returns early
+// once shared->done is set.
+//
+// If `restart` isn't null, the search starts with what it has learned and returns early after
+// restart->nodes nodes. Then restart gets what the search has learned.
+Solution Optimize(Search& search, Solution incumbent, ostream* log, const string& checkpoint = {},
+                  chrono::seconds period = chrono::minutes(10), SharedBest* shared = nullptr,
+                  Restart* restart = nullptr) {
+  const Instance& instance = search.instance;
+  Checkpoint saved;
+  if (!checkpoint.empty() && saved.Load(checkpoint)) {
+    if (saved.size != instance.size() || saved.fingerprint != instance.Fingerprint() ||
+        search.nodes) {
+      throw runtime_error(checkpoint + " is from another search");
+    }
+    for (uint32_t j : saved.best.items) {
+      if (j >= instance.size()) throw runtime_error("bad checkpoint " + checkpoint);
+    }
+    if (saved.best.score.BetterThan(incumbent.score)) incumbent = saved.best;
+  }
+  Solution& best = incumbent;
+  Lagrangian lagrangian(search, best.score);
+  for (uint32_t j : saved.excluded) {
+    if (j >= instance.size()) throw runtime_error("bad checkpoint " + checkpoint);
+    search.Exclude(j);
+  }
+  if (restart) {
+    for (uint32_t j : restart->excluded) search.Exclude(j);
+  }
+  lagrangian.Fix(best.score);
+  if (instance.lagrangian) search.trackers.push_back(&lagrangian);
+  TopGains top_gains(search);
+  if (instance.top_gains) search.trackers.push_back(&top_gains);
+  Nogoods nogoods(search);
+  search.trackers.push_back(&nogoods);
+  if (restart) nogoods.Import(restart->nogoods);
+  if (saved.nodes) {
+    search.Resume(saved.assignments, saved.nodes);
+    if (log) *log << "Resumed after " << saved.nodes << " nodes" << endl;
+  }
+  const auto start = chrono::steady_clock::now();
+  const uint64_t start_nodes = search.nodes;
+  auto next = start + period, report = start + chrono::seconds(instance.progress);
+  uint64_t seen = 0;
+  // Estimates are heavy-tailed and need many probes, but a probe takes about a microsecond.
+  constexpr int kProbes = 1 << 12;
+  mt19937_64 rng(1);
+  if (log && instance.progress > 0) {
+    *log << "==[ Estimated nodes: " << uint64_t(search.Estimate(best.score, 16 * kProbes, rng))
+         << " ]==" << endl;
+  }
+  auto visit = [&](const Score& s, bool leaf) {
+    if (!(search.nodes & 0xfff)) {
+      if (stats_requested.exchange(false)) {
+        cerr << "==[ Stats: " << search.nodes << " nodes, depth " << search.scores.size() - 1
+             << ", best " << instance.Format(best.score) << " ]==" << endl;
+      }
+      auto now = chrono::steady_clock::now();
+      if (log && instance.progress > 0 && now >= report) {
+        double left = search.Estimate(best.score, kProbes, rng);
+        double rate = (search.nodes - start_nodes) / chrono::duration<double>(now - start).count();
+        *log << "==[ Progress: " << int(100 * search.nodes / (search.nodes + left)) << "%, "
+             << search.nodes << " nodes, ETA " << llround(left / rate) << "s ]==" << endl;
+        report = now + chrono::seconds(instance.progress);
+      }
+      if (shared && shared->Take(best, seen)) lagrangian.Fix(best.score);
+      if (stop_requested || (shared && shared->done) || (!checkpoint.empty() && now >= next) ||
+          (restart && search.nodes >= restart->nodes)) {
+        search.Pause();
+      }
+    }
+    if (nogoods.conflict) {
+      nogoods.conflict = false;
+      return false;
+    }
+    if (s.BetterThan(best.score)) {
+      best = {s, search.Used()};
+      lagrangian.Fix(best.score);
+      if (log) Print(*log, instance, "New best assignment", best);
+      if (shared) shared->Offer(best);
+    }
+    if (leaf || (instance.lagrangian && !lagrangian.MayImprove(s, best.score))) return false;
+    if (!instance.MayImprove(s, search.book, best.score)) {
+      nogoods.Learn(best.score);
+      return false;
+    }
+    if (instance.top_gains && !top_gains.MayImprove(s, search.book, best.score)) return false;
+    return int(search.scores.size()) - 1 > instance.lp_depth || LpMayImprove(search, s, best.score);
+  };
+  while (!search.Run(visit)) {
+    if (!checkpoint.empty()) {
+      Checkpoint{instance.size(), instance.Fingerprint(), search.nodes, best, search.assignments,
+                 search.Excluded()}
+          .Save(checkpoint);
+      next = chrono::steady_clock::now() + period;
+    }
+    if (stop_requested) {
+      if (log) {
+        Print(*log, instance, "Stopped, best assignment", best);
+        *log << "==[ Bound: " << instance.Format(search.Bound(best.score)) << " ]==" << endl;
+      }
+      return best;
+    }
+    if (shared && shared->done) return best;
+    if (restart && search.nodes >= restart->nodes) {
+      restart->excluded = search.Excluded();
+      restart->nogoods = nogoods.Clauses();
+      return best;
+    }
+  }
+  if (!checkpoint.empty()) remove(checkpoint.c_str());
+  if (restart) restart->done = true;
+  return best;
+}
+
+// Finds the best solution that is better than the incumbent. If there is no such solution,
+// returns the incumbent. All items in `forced` are used by every solution that Optimize()
+// considers. If `log` isn't null, every new best solution gets printed to it.
+Solution Optimize(const Instance& instance, Solution incumbent, const vector<uint32_t>& forced = {},
+                  ostream* log = &cout) {
+  Search search(instance, instance.book, forced);
+  return Optimize(search, incumbent, log);
+}
+
+// Finds the best solution for every book capacity from instance.book to instance.book plus
+// `extra` slots in every row: res[e] is the best solution with e more slots per row.
+//
+// All capacities share a single search with the largest one. A node counts for every capacity
+// that fits its items, so the best solution for a smaller capacity is the incumbent for all
+// larger ones. A subtree is cut only if it can't improve the solution for any capacity.
+//
+// On stop_requested, returns the best solutions so far.
+vector<Solution> Sweep(const Instance& instance, uint8_t extra) {
+  vector<Solution> res(extra + 1);
+  Book capacity = instance.book;
+  for (uint8_t& n : capacity) {
+    if (n + extra > numeric_limits<uint8_t>::max()) throw runtime_error("too many slots");
+    n += extra;
+  }
+  Search search(instance, capacity, {});
+  TopGains top_gains(search);
+  if (instance.top_gains) search.trackers.push_back(&top_gains);
+  search.Run([&](const Score& s, bool leaf) {
+    if (!(search.nodes & 0xfff) && stop_requested) search.Pause();
+    // The fewest extra slots per row that fit the used items.
+    int need = 0;
+    for (uint8_t n : search.book) need = max(need, extra - n);
+    bool may_improve = false;
+    for (int e = need; e <= extra; ++e) {
+      // Items that don't fit the library as it is move fewer items out with more slots.
+      Score t = s;
+      if (instance.track_moves) t.moves = instance.Moves(t.put_in, e);
+      if (t.BetterThan(res[e].score)) res[e] = {t, search.Used()};
+      if (leaf || may_improve) continue;
+      Book book = search.book;
+      for (uint8_t& n : book) n -= extra - e;
+      may_improve = instance.MayImprove(t, book, res[e].score) &&
+                    (!instance.top_gains || top_gains.MayImprove(t, book, res[e].score));
+    }
+    return may_improve;
+  });
+  return res;
+}
+
+// Splits the items into parts that don't interact: items of different parts provide different
+// tripods, and every row that holds items of several parts has room for all of them. Parts without
+// items that provide tripods of some class are dropped.
+vector<vector<uint32_t>> Parts(const Instance& instance) {
+  vector<uint32_t> parent(instance.size());
+  for (uint32_t i = 0; i != parent.size(); ++i) parent[i] = i;
+  auto find = [&](uint32_t i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  auto unite = [&](const vector<uint32_t>& v) {
+    for (uint32_t i : v) parent[find(i)] = find(v[0]);
+  };
+
+  vector<bool> useful(instance.size());
+  for (const vector<uint32_t>& v : instance.candidates) {
+    for (uint32_t i : v) useful[i] = true;
+    if (!v.empty()) unite(v);
+  }
+  // A row binds if it can't hold all items that may end up in it: the useful ones and, since
+  // taking an item out of the library is a move, the placed ones. Placed items of such rows go to
+  // the parts as well, so that the parts see how full their rows are.
+  array<vector<uint32_t>, kRows> rows;
+  for (uint32_t i = 0; i != instance.size(); ++i) {
+    if (useful[i] || instance.placed[i]) rows[instance.rows[i]].push_back(i);
+  }
+  for (uint8_t r = 0; r != kRows; ++r) {
+    if (rows[r].size() > instance.book[r]) unite(rows[r]);
+  }
+
+  vector<vector<uint32_t>> res(instance.size());
+  for (uint32_t i = 0; i != instance.size(); ++i) res[find(i)].push_back(i);
+  erase_if(res, [&](const vector<uint32_t>& v) {
+    return none_of(v.begin(), v.end(), [&](uint32_t i) { return useful[i]; });
+  });
+  return res;
+}
+
+// Same as Optimize(instance, {}), but optimizes every part from Parts() on its own, in parallel,
+// and puts the best solutions of the parts together. Every part only sees the tripods of its
+// items.
+Solution OptimizeParts(const Instance& instance, const vector<Item>& items, ostream* log = &cout) {
+  vector<vector<uint32_t>> parts = Parts(instance);
+  if (parts.size() < 2) return Optimize(instance, {}, {}, log);
+
+  vector<Solution> res(parts.size());
+  atomic<size_t> next = 0;
+  auto work = [&] {
+    for (size_t p; (p = next++) < parts.size();) {
+      vector<Item> part_items;
+      vector<uint32_t> placed;
+      set<uint8_t> tripods;
+      for (uint32_t i : parts[p]) {
+        if (instance.placed[i]) placed.push_back(part_items.size());
+        part_items.push_back(items[i]);
+        tripods.insert(items[i].tripods, items[i].tripods + kTripods);
+      }
+      vector<Class> classes = instance.classes;
+      for (Class& cls : classes) {
+        vector<uint8_t> kept;
+        for (uint8_t k = 0, i = 0; k <= cls.tiers.size(); ++k) {
+          uint8_t end = k == cls.tiers.size() ? cls.tripods.size() : i + cls.tiers[k];
+          uint8_t n = 0;
+          for (; i != end && i != cls.tripods.size(); ++i) {
+            if (!tripods.count(cls.tripods[i])) continue;
+            kept.push_back(cls.tripods[i]);
+            ++n;
+          }
+          if (k != cls.tiers.size()) cls.tiers[k] = n;
+        }
+        cls.tripods = kept;
+      }
+      Instance part(part_items, classes, instance.book, placed);
+      part.lp_depth = instance.lp_depth;
+      part.lagrangian = instance.lagrangian;
+      part.top_gains = instance.top_gains;
+      part.track_moves = instance.track_moves;
+      for (uint32_t i : Optimize(part, {}, {}, nullptr).items) res[p].items.push_back(parts[p][i]);
+    }
+  };
+  vector<thread> threads(min<size_t>(max(1u, thread::hardware_concurrency()), parts.size()));
+  for (thread& t : threads) t = thread(work);
+  for (thread& t : threads) t.join();
+
+  Solution best;
+  for (const Solution& s : res) best.items.insert(best.items.end(), s.items.begin(), s.items.end());
+  sort(best.items.begin(), best.items.end());
+  for (uint32_t i : best.items) instance.Add(best.score, i);
+  if (log) {
+    Print(*log, instance,
+          (stop_requested ? "Stopped, best assignment of " : "Best assignment of ") +
+              to_string(parts.size()) + " parts",
+          best);
+  }
+  return best;
+}
+
+// Same as Optimize(instance, {}), but on `threads` threads, and runs with the same number of
+// threads visit the same nodes and print the same output.
+//
+// The work is the subtrees of the children of the root, in the order of the sequential search.
+// It goes in epochs of `threads` subtrees, and thread t always gets the t-th subtree of an epoch.
+// Every subtree starts with the best solution of the previous epochs as the incumbent, and the
+// best solutions of an epoch get merged in order, with ties going to the one that uses the
+// lexicographically smallest list of items.
+Solution OptimizeInEpochs(const Instance& instance, unsigned threads, ostream* log = &cout) {
+  Search root(instance, instance.book, {});
+  ++root.nodes;
+  vector<pair<size_t, uint32_t>> work;
+  root.Children(0, root.DepthLimit(root.scores.back()), work);
+
+  Solution best;
+  for (size_t first = 0; first < work.size() && !stop_requested; first += threads) {
+    size_t n = min<size_t>(threads, work.size() - first);
+    vector<Solution> res(n, best);
+    vector<uint64_t> nodes(n);
+    // Bounds of the subtrees that got stopped.
+    vector<Score> bounds(n);
+    vector<thread> pool;
+    for (size_t t = 0; t != n; ++t) {
+      pool.emplace_back([&, t] {
+        auto [d, j] = work[first + t];
+        Search search(instance, instance.book, {j}, d + 1);
+        res[t] = Optimize(search, res[t], nullptr);
+        nodes[t] = search.nodes;
+        bounds[t] = stop_requested ? search.Bound(res[t].score) : res[t].score;
+      });
+    }
+    for (thread& t : pool) t.join();
+    for (size_t t = 0; t != n; ++t) {
+      root.nodes += nodes[t];
+      if (res[t].score.BetterThan(best.score) ||
+          (!best.score.BetterThan(res[t].score) && res[t].items < best.items)) {
+        best = res[t];
+        if (log) Print(*log, instance, "New best assignment", best);
+      }
+    }
+    if (stop_requested && log) {
+      // The rest of the search is the stopped subtrees and the ones of the later epochs.
+      Score bound = best.score;
+      for (const Score& b : bounds) bound.Join(b);
+      for (size_t i = first + n; i != work.size(); ++i) {
+        auto [d, j] = work[i];
+        bound.Join(Search(instance, instance.book, {j}, d + 1).Bound(best.score));
+      }
+      Print(*log, instance, "Stopped, best assignment", best);
+      *log << "==[ Bound: " << instance.Format(bound) << " ]==" << endl;
+    }
+  }
+  if (log) *log << "==[ Nodes: " << root.nodes << " ]==\n" << flush;
+  return best;
+}
+
+// Same as Optimize(instance, {}), but expands nodes in the order of their bounds from
+// Instance::Bound(), the most promising first, so that good solutions come sooner. After every
+// expansion, it dives into a child until it reaches a leaf, which finds solutions that prune the
+// frontier. Nodes wait in the frontier as bitsets of their items. Once the frontier
+// takes `memory` bytes, its worse half gets searched depth-first.
+Solution OptimizeBestFirst(const Instance& instance, size_t memory, ostream* log = &cout) {
+  struct Node {
+    // The bound of the subtree, and the tiers, cost and moves of the node itself.
+    array<int32_t, kMaxTiers> bound;
+    array<int32_t, kMaxTiers> tiers;
+    uint32_t cost;
+    uint16_t moves;
+    // The number of picked items. Deeper nodes go first among otherwise equal ones.
+    uint16_t picks;
+    // The depth of the last pick plus one, as Search::floor.
+    uint32_t from;
+    vector<uint64_t> items;
+  };
+  auto better = [](const Node& a, const Node& b) {
+    if (auto c = tie(a.bound, a.tiers) <=> tie(b.bound, b.tiers); c != 0) return c > 0;
+    return tie(a.cost, a.moves, b.picks) < tie(b.cost, b.moves, a.picks);
+  };
+  multiset<Node, decltype(better)> frontier(better);
+  const size_t words = (instance.size() + 63) / 64;
+  const size_t capacity = max<size_t>(memory / (sizeof(Node) + words * 8 + 64), 2);
+
+  Solution best;
+  auto items = [&](const Node& node) {
+    vector<uint32_t> res;
+    for (uint32_t j = 0; j != instance.size(); ++j) {
+      if (node.items[j / 64] >> j % 64 & 1) res.push_back(j);
+    }
+    return res;
+  };
+  // Takes a node with score `s` and free slots in `book`. Returns where it went in the frontier,
+  // or frontier.end() if its subtree can't improve the incumbent.
+  auto push = [&](Node node, const Score& s, const Book& book) {
+    if (s.BetterThan(best.score)) {
+      best = {s, items(node)};
+      if (log) Print(*log, instance, "New best assignment", best);
+    }
+    if (!instance.MayImprove(s, book, best.score)) return frontier.end();
+    node.bound = instance.Bound(s, book).tiers;
+    node.tiers = s.tiers;
+    node.cost = s.cost;
+    node.moves = s.moves;
+    return frontier.insert(move(node));
+  };
+  {
+    Search root(instance, instance.book, {});
+    push({.picks = 0, .from = 0, .items = vector<uint64_t>(words)}, root.scores.back(), root.book);
+  }
+
+  vector<pair<size_t, uint32_t>> children;
+  auto dive = frontier.end();
+  while (!frontier.empty() && !stop_requested) {
+    if (frontier.size() > capacity) {
+      for (size_t n = frontier.size() / 2; n-- && !stop_requested;) {
+        auto worst = prev(frontier.end());
+        Search search(instance, instance.book, items(*worst), worst->from);
+        frontier.erase(worst);
+        // Most of these subtrees are tiny, too small to pay for the bounds that Optimize() sets
+        // up.
+        search.Run([&](const Score& s, bool leaf) {
+          if (s.BetterThan(best.score)) {
+            best = {s, search.Used()};
+            if (log) Print(*log, instance, "New best assignment", best);
+          }
+          return !leaf && instance.MayImprove(s, search.book, best.score);
+        });
+      }
+      dive = frontier.end();
+      continue;
+    }
+    Node node = move(frontier.extract(dive != frontier.end() ? dive : frontier.begin()).value());
+    dive = frontier.end();
+    Search search(instance, instance.book, items(node), node.from);
+    const Score& s = search.scores.back();
+    if (!instance.MayImprove(s, search.book, best.score)) continue;
+    children.clear();
+    search.Children(node.from, search.DepthLimit(s), children);
+    for (auto [d, j] : children) {
+      Node child = node;
+      child.items[j / 64] |= uint64_t{1} << j % 64;
+      ++child.picks;
+      child.from = d + 1;
+      Score t = s;
+      instance.Add(t, j);
+      Book book = search.book;
+      --book[instance.rows[j]];
+      auto it = push(move(child), t, book);
+      // Dives go for the first tripod that misses an item, as the depth-first search does.
+      if (it != frontier.end() &&
+          (dive == frontier.end() || tie(dive->from, it->tiers) > tie(it->from, dive->tiers))) {
+        dive = it;
+      }
+    }
+  }
+  if (stop_requested && log) {
+    // The rest of the search is the subtrees of the frontier. Costs and moves only grow in them.
+    Score bound = best.score;
+    for (const Node& node : frontier) {
+      bound.Join({.tiers = node.bound, .cost = node.cost, .moves = node.moves});
+    }
+    Print(*log, instance, "Stopped, best assignment", best);
+    *log << "==[ Bound: " << instance.Format(bound) << " ]==" << endl;
+  }
+  return best;
+}
+
+// Finds a good solution fast with beam search. It goes through the tripods in Instance::order
+// and keeps `width` partial solutions after every tripod, each of which may or may not pick an
+// item for it. Partial solutions with the same levels of all tripods and the same free slots
+// have the same future, so only the best of them stays. The ones that stay are the best by their
+// own score, then by Instance::Bound(). The bound alone would favor the ones that skip tripods,
+// since it doesn't know that they never get an item for them. Wider beams find better solutions
+// but take longer.
+Solution BeamSearch(const Instance& instance, size_t width, ostream* log = &cout) {
+  struct State {
+    Score score;
+    Score bound;
+    Book book;
+    vector<uint32_t> items;
+  };
+  auto better = [](const State& a, const State& b) {
+    if (a.score.BetterThan(b.score)) return true;
+    return !b.score.BetterThan(a.score) && a.bound.BetterThan(b.bound);
+  };
+  Solution best;
+  vector<State> beam = {{.book = instance.book}};
+  beam[0].bound = instance.Bound(beam[0].score, beam[0].book);
+  for (size_t d = 0; d != instance.order.size() && !beam.empty(); ++d) {
+    map<pair<Levels, Book>, State> next;
+    auto offer = [&](State&& state) {
+      if (state.score.BetterThan(best.score)) best = {state.score, state.items};
+      if (!instance.MayImprove(state.score, state.book, best.score)) return;
+      auto [it, added] = next.try_emplace({state.score.tripods, state.book}, state);
+      if (!added && better(state, it->second)) it->second = move(state);
     };
-    return score(*this) > score(other);
+    auto [c, i] = instance.order_places[d];
+    for (State& state : beam) {
+      const uint8_t stored = Lane(state.score.tripods, c, i);
+      for (size_t a = 0; a != instance.candidates[d].size(); ++a) {
+        uint32_t j = instance.candidates[d][a];
+        if (instance.candidate_levels[d][a] <= stored || !state.book[instance.rows[j]] ||
+            find(state.items.begin(), state.items.end(), j) != state.items.end()) {
+          continue;
+        }
+        State child = state;
+        instance.Add(child.score, j);
+        --child.book[instance.rows[j]];
+        child.items.push_back(j);
+        child.bound = instance.Bound(child.score, child.book);
+        offer(move(child));
+      }
+      offer(move(state));
+    }
+    beam.clear();
+    for (auto& [key, state] : next) beam.push_back(move(state));
+    if (beam.size() > width) {
+      nth_element(beam.begin(), beam.begin() + width, beam.end(), better);
+      beam.resize(width);
+    }
+  }
+  sort(best.items.begin(), best.items.end());
+  if (log) Print(*log, instance, "Beam search assignment", best);
+  return best;
+}
+
+// Same as Optimize(instance, {}), but first looks for solutions close to the greedy one with
+// limited discrepancy search, then proves the best of them optimal with Optimize().
+//
+// The greedy choice at a node picks an item for the first tripod that can still get a better
+// level, the item that improves the score the most. Every other child of the node is a
+// discrepancy. Pass k visits the nodes with at most k discrepancies on the way to them, for k =
+// 0, 1, ..., max_discrepancies.
+Solution OptimizeWithDiscrepancies(const Instance& instance, int max_discrepancies,
+                                   ostream* log = &cout) {
+  Solution best;
+  vector<pair<size_t, uint32_t>> children;
+  for (int k = 0; k <= max_discrepancies && !stop_requested; ++k) {
+    Search search(instance, instance.book, {});
+    // For every node on the path to the current one: the number of discrepancies on the way
+    // to it and its greedy child as (depth, item).
+    vector<pair<int, pair<size_t, uint32_t>>> path;
+    search.Run([&](const Score& s, bool leaf) {
+      size_t n = search.scores.size() - 1;
+      int discrepancies = 0;
+      size_t from = 0;
+      if (n) {
+        size_t d = search.assignments.size() - 1;
+        pair<size_t, uint32_t> pick = {d, instance.candidates[d][search.assignments[d]]};
+        discrepancies = path[n - 1].first + (path[n - 1].second != pick);
+        from = d + 1;
+      }
+      if (discrepancies > k) return false;
+      if (s.BetterThan(best.score)) {
+        best = {s, search.Used()};
+        if (log) Print(*log, instance, "New best assignment", best);
+      }
+      if (leaf || !instance.MayImprove(s, search.book, best.score)) return false;
+
+      children.clear();
+      search.Children(from, search.DepthLimit(s), children);
+      if (children.empty()) return false;
+      pair<size_t, uint32_t> greedy = children.back();
+      Score greedy_score = s;
+      instance.Add(greedy_score, greedy.second);
+      for (auto it = children.rbegin(); it != children.rend() && it->first == greedy.first; ++it) {
+        Score t = s;
+        instance.Add(t, it->second);
+        if (t.BetterThan(greedy_score)) tie(greedy, greedy_score) = tie(*it, t);
+      }
+      path.resize(n);
+      path.push_back({discrepancies, greedy});
+      return true;
+    });
+  }
+  return Optimize(instance, best, {}, log);
+}
+
+// The Luby sequence 1, 1, 2, 1, 1, 2, 4, 1, 1, 2, ... for i = 1, 2, ...
+uint64_t Luby(uint64_t i) {
+  for (;;) {
+    int k = bit_width(i);
+    if (i == (uint64_t(1) << k) - 1) return uint64_t(1) << (k - 1);
+    i -= (uint64_t(1) << (k - 1)) - 1;
   }
+}
 
-  int tripod_count(uint64_t mask = -1) const { return popcount(tripods & mask); }
+// Same as Optimize(instance, {}), but restarts the search after Luby(r) * unit nodes in run r.
+// Run-times of a search vary a lot with the order of the tripods and candidates, so every run
+// after the first one breaks the ties of the usual order at random, see Instance::Shuffle().
+// The incumbent, the excluded items and the nogoods carry over to the next run. The runs get
+// longer and longer until one of them finishes.
+Solution OptimizeWithRestarts(const Instance& instance, uint64_t unit, ostream* log = &cout) {
+  mt19937_64 rng(1);
+  Solution best;
+  Restart restart;
+  uint64_t runs = 0;
+  while (!restart.done && !stop_requested) {
+    Instance local = instance;
+    if (runs) local.Shuffle(rng);
+    Search search(local, local.book, {});
+    restart.nodes = Luby(++runs) * unit;
+    best = Optimize(search, best, log, {}, {}, nullptr, &restart);
+  }
+  if (log) *log << "==[ Runs: " << runs << " ]==" << endl;
+  return best;
+}
 
-  uint64_t tripods = 0;
-  uint32_t cost = 0;
+// Races several configurations of the search on their own threads, which share the incumbent.
+// The first configuration that finishes its search proves the incumbent optimal and ends the
+// race. The winner gets printed, so its settings can become the defaults.
+//
+// The configurations are the usual search, the search that picks items for the tripods with the
+// fewest candidates first, the one that tries the cheapest candidates first, and large
+// neighborhood search: it keeps the items of the incumbent in all but two random rows and
+// optimizes the rest. The latter only improves the incumbent and never wins.
+Solution OptimizePortfolio(const Instance& instance, ostream* log = &cout) {
+  SharedBest shared{instance, log};
+  string winner;
+  // Every configuration but the last one searches the whole tree, so the bound of any of them
+  // holds. The lowest one gets printed.
+  std::mutex mutex;
+  optional<Score> bound;
+  auto race = [&](string_view name, auto setup) {
+    return thread([&, name, setup] {
+      Instance local = instance;
+      setup(local);
+      Search search(local, local.book, {});
+      Solution res = Optimize(search, {}, nullptr, {}, {}, &shared);
+      if (!stop_requested && !shared.done.exchange(true)) winner = name;
+      if (stop_requested) {
+        Score b = search.Bound(res.score);
+        lock_guard lock(mutex);
+        if (!bound || bound->BetterThan(b)) bound = b;
+      }
+    });
+  };
+  vector<thread> threads;
+  threads.push_back(race("usual", [](Instance&) {}));
+  threads.push_back(race("fewest candidates first", [](Instance& i) {
+    i.SortTripodsByCandidates();
+  }));
+  threads.push_back(race("cheapest first", [](Instance& i) { i.SortCandidatesByCost(); }));
+  threads.emplace_back([&] {
+    mt19937_64 rng(1);
+    Solution best;
+    uint64_t seen = 0;
+    while (!shared.done && !stop_requested) {
+      shared.Take(best, seen);
+      if (best.items.empty()) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        continue;
+      }
+      uint8_t keep = ~(1 << rng() % kRows | 1 << rng() % kRows);
+      vector<uint32_t> forced;
+      for (uint32_t j : best.items) {
+        if (keep >> instance.rows[j] & 1) forced.push_back(j);
+      }
+      Search search(instance, instance.book, forced);
+      best = Optimize(search, best, nullptr, {}, {}, &shared);
+    }
+  });
+  for (thread& t : threads) t.join();
+  if (log && !winner.empty()) *log << "==[ Portfolio winner: " << winner << " ]==" << endl;
+  if (log && winner.empty() && bound) {
+    bound->Join(shared.best.score);
+    Print(*log, instance, "Stopped, best assignment", shared.best);
+    *log << "==[ Bound: " << instance.Format(*bound) << " ]==" << endl;
+  }
+  return shared.best;
+}
+
+// For every candidate item, finds the best solution with this item added to the instance.
+// `base` must be the optimal solution of the instance without candidates. Candidates are
+// evaluated in parallel.
+//
+// A solution that is better than `base` must use the candidate, so every search forces the
+// candidate in and starts with `base` as the incumbent.
+vector<Solution> WhatIf(const Instance& instance, const Solution& base,
+                        const vector<Item>& candidates) {
+  vector<Solution> res(candidates.size(), base);
+  atomic<size_t> next = 0;
+  auto work = [&] {
+    Instance local = instance;
+    for (size_t i; (i = next++) < candidates.size();) {
+      local.Add(candidates[i]);
+      res[i] = Optimize(local, base, {local.size() - 1}, nullptr);
+      local.Pop();
+    }
+  };
+  vector<thread> threads(min<size_t>(max(1u, thread::hardware_concurrency()), candidates.size()));
+  for (thread& t : threads) t = thread(work);
+  for (thread& t : threads) t.join();
+  return res;
+}
+
+// Finds the `k` best solutions, the best first. Solutions that differ only in interchangeable
+// items count as one, see Instance::twin.
+//
+// The search reaches a set of items once for every order of the tripods it picks them for, so
+// a node only counts if its items aren't among the solutions with the same score yet.
+vector<Solution> Top(const Instance& instance, size_t k) {
+  vector<Solution> res;
+  if (!k) return res;
+  Search search(instance, instance.book, {});
+  search.Run([&](const Score& s, bool leaf) {
+    if (!(search.nodes & 0xfff) && stop_requested) search.Pause();
+    if (res.size() < k || s.BetterThan(res.back().score)) {
+      auto first = lower_bound(res.begin(), res.end(), s, [](const Solution& a, const Score& b) {
+        return a.score.BetterThan(b);
+      });
+      auto last = upper_bound(first, res.end(), s, [](const Score& a, const Solution& b) {
+        return a.BetterThan(b.score);
+      });
+      vector<uint32_t> items = search.Used();
+      if (none_of(first, last, [&](const Solution& x) { return x.items == items; })) {
+        res.insert(last, {s, move(items)});
+        if (res.size() > k) res.pop_back();
+      }
+    }
+    if (leaf) return false;
+    return res.size() < k || instance.MayImprove(s, search.book, res.back().score);
+  });
+  return res;
+}
+
+// The physical library. Every page has a row for each kind of item, and every row of every
+// page has the same number of slots.
+struct Layout {
+  struct Placement {
+    uint32_t item;
+    uint8_t page;
+    uint8_t slot;
+  };
+
+  // Pages first_page, first_page + 1, ..., first_page + pages - 1 as numbered in the game.
+  uint8_t first_page = 1;
+  uint8_t pages = 0;
+  // Slots in a row of a page, numbered from 1.
+  uint8_t slots = 0;
+  // Items that are in the library now.
+  vector<Placement> placed;
 };
 
-struct Assignment {
-  size_t item = -1;
-  Score score;
+struct Move {
+  // Whether the item goes into the slot or gets taken out of it.
+  bool put_in;
+  uint32_t item;
+  uint8_t page;
+  uint8_t slot;
 };
 
-void Optimize(vector<Item>& items, int prio_tripods, Book book) {
-  const uint64_t prio_mask = (uint64_t{1} << prio_tripods) - 1;
+// Solves the assignment problem with the Hungarian algorithm in O(n^2 * m): returns a column
+// for every row of the n x m matrix `cost` so that the columns are distinct and their total
+// cost is the smallest. Requires n <= m.
+vector<size_t> Assign(const vector<vector<int64_t>>& cost) {
+  if (cost.empty()) return {};
+  const size_t n = cost.size(), m = cost[0].size();
+  const int64_t kInf = numeric_limits<int64_t>::max();
+  // Potentials of rows and columns, the row matched to every column (1-based, 0 is none) and
+  // the previous column on the augmenting path. Column 0 is a fake one.
+  vector<int64_t> u(n + 1), v(m + 1);
+  vector<size_t> match(m + 1), way(m + 1);
+  for (size_t i = 1; i <= n; ++i) {
+    match[0] = i;
+    size_t j0 = 0;
+    vector<int64_t> min_slack(m + 1, kInf);
+    vector<bool> done(m + 1);
+    do {
+      done[j0] = true;
+      size_t i0 = match[j0], j1 = 0;
+      int64_t delta = kInf;
+      for (size_t j = 1; j <= m; ++j) {
+        if (done[j]) continue;
+        int64_t slack = cost[i0 - 1][j - 1] - u[i0] - v[j];
+        if (slack < min_slack[j]) {
+          min_slack[j] = slack;
+          way[j] = j0;
+        }
+        if (min_slack[j] < delta) {
+          delta = min_slack[j];
+          j1 = j;
+        }
+      }
+      for (size_t j = 0; j <= m; ++j) {
+        if (done[j]) {
+          u[match[j]] += delta;
+          v[j] -= delta;
+        } else {
+          min_slack[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (match[j0]);
+    for (size_t j1; j0; j0 = j1) {
+      j1 = way[j0];
+      match[j0] = match[j1];
+    }
+  }
+  vector<size_t> res(n);
+  for (size_t j = 1; j <= m; ++j) {
+    if (match[j]) res[match[j] - 1] = j - 1;
+  }
+  return res;
+}
+
+// Returns the shortest sequence of moves that turns the library described by `layout` into one
+// that holds the items of `solution`: first all items that have to go are taken out, then the
+// new ones are put in. Items that are in the library but not in the solution stay where they are
+// as long as their row has room for them.
+//
+// Every row is an assignment problem solved with Assign(): an item that stays in its slot costs
+// nothing, an item that gets put in costs one move, and an item that changes its slot costs two.
+// Among plans with the same number of moves, new items go to the earliest free slots.
+vector<Move> PlanMoves(const Layout& layout, const Instance& instance, const Solution& solution) {
+  const size_t per_row = layout.pages * layout.slots;
+  // Slots of every row are numbered page by page. Items in the library now, by row and slot.
+  vector<vector<int64_t>> now(kRows, vector<int64_t>(per_row, -1));
+  vector<int64_t> where(instance.size(), -1);
+  for (const Layout::Placement& p : layout.placed) {
+    if (p.page < layout.first_page || p.page - layout.first_page >= layout.pages || !p.slot ||
+        p.slot > layout.slots || p.item >= instance.size()) {
+      throw runtime_error("invalid placement of item #" + to_string(p.item));
+    }
+    size_t slot = (p.page - layout.first_page) * layout.slots + p.slot - 1;
+    int64_t& x = now[instance.rows[p.item]][slot];
+    if (x >= 0) throw runtime_error("two items in one slot");
+    x = p.item;
+    where[p.item] = slot;
+  }
 
-  vector<vector<Item*>> tripods;
-  for (Item& item : items) {
-    for (uint8_t tripod : item.tripods) {
-      if (!tripod) continue;
-      if (tripods.size() < tripod) tripods.resize(tripod);
-      tripods[tripod - 1].push_back(&item);
+  vector<bool> wanted(instance.size());
+  for (uint32_t i : solution.items) wanted[i] = true;
+  vector<Move> take_out, put_in;
+  for (uint8_t r = 0; r != kRows; ++r) {
+    vector<uint32_t> items;
+    for (uint32_t i : solution.items) {
+      if (instance.rows[i] == r) items.push_back(i);
+    }
+    if (items.size() > per_row) throw runtime_error("solution doesn't fit into the library");
+    for (int64_t i : now[r]) {
+      if (i >= 0 && !wanted[i] && items.size() < per_row) items.push_back(i);
+    }
+    vector<vector<int64_t>> cost(items.size(), vector<int64_t>(per_row));
+    for (size_t i = 0; i != items.size(); ++i) {
+      for (size_t slot = 0; slot != per_row; ++slot) {
+        int64_t moves = where[items[i]] < 0 ? 1 : where[items[i]] == int64_t(slot) ? 0 : 2;
+        cost[i][slot] = moves ? moves * per_row + slot : 0;
+      }
+    }
+    vector<size_t> slots = Assign(cost);
+    vector<int64_t> then(per_row, -1);
+    for (size_t i = 0; i != items.size(); ++i) then[slots[i]] = items[i];
+    auto move = [&](bool put, uint32_t item, size_t slot) {
+      (put ? put_in : take_out)
+          .push_back({put, item, uint8_t(layout.first_page + slot / layout.slots),
+                      uint8_t(slot % layout.slots + 1)});
+    };
+    for (size_t slot = 0; slot != per_row; ++slot) {
+      if (now[r][slot] == then[slot]) continue;
+      if (now[r][slot] >= 0) move(false, now[r][slot], slot);
+      if (then[slot] >= 0) move(true, then[slot], slot);
     }
   }
+  take_out.insert(take_out.end(), put_in.begin(), put_in.end());
+  return take_out;
+}
 
-  Score best_score = {};
-  vector<Assignment> assignments(tripods.size());
+// Reads market listings from `in`, one per line: row, cost and up to kTripods tripods separated
+// by whitespace. Rows and tripods are named like in Main() but without the leading 'k'. A tripod
+// can have a level after a colon: "Inferno_FlameArea:5". Empty lines and lines starting with '#'
+// are ignored.
+//
+// Only the listings that can be useful get appended to `items`:
+//
+// - Tripods that no class in `classes` uses are dropped, so they don't keep apart listings that
+//   are the same for the classes. So are the listings left without tripods.
+// - Listings that are no better than an item from `items` with zero cost (the same row and a
+//   superset of tripods with the same or higher levels) are dropped.
+// - Out of the listings with the same row and the same tripods and levels, only `keep` cheapest
+//   are kept.
+//
+// Listings are processed as they are read, so memory use doesn't depend on the file size. If `log`
+// isn't null, it gets the number of kept listings.
+void ReadMarket(istream& in, const vector<string>& row_names, const vector<string>& tripod_names,
+                const vector<Class>& classes, size_t keep, vector<Item>& items,
+                ostream* log = &cerr) {
+  unordered_map<string_view, uint8_t> rows, tripods;
+  for (size_t i = 0; i != row_names.size(); ++i) rows[row_names[i]] = i;
+  for (const Class& cls : classes) {
+    for (uint8_t t : cls.tripods) {
+      if (t && t < tripod_names.size()) tripods[tripod_names[t]] = t;
+    }
+  }
 
-  while (!assignments.empty()) {
-    uint8_t tripod = assignments.size();
-    vector<Item*>& v = tripods[tripod - 1];
-    Assignment& a = assignments.back();
-    Assignment prev = tripod > 1 ? assignments[tripod - 2] : Assignment();
+  // (tripod, level) pairs of an item, sorted and padded with zeros at the end.
+  using Tripods = array<pair<uint8_t, uint8_t>, kTripods>;
+  auto normalize = [](Tripods& x) {
+    sort(x.begin(), x.end(), [](auto a, auto b) { return (a.first - 1u) < (b.first - 1u); });
+  };
+  // Whether x has every tripod of y with at least the same level.
+  auto covers = [](const Tripods& x, const Tripods& y) {
+    return all_of(y.begin(), y.end(), [&](auto b) {
+      return !b.first || any_of(x.begin(), x.end(), [&](auto a) {
+        return a.first == b.first && a.second >= b.second;
+      });
+    });
+  };
 
-    if (a.item != static_cast<size_t>(-1)) {
-      v[a.item]->used = false;
-      ++book[v[a.item]->row];
-    } else if (prev.score.tripods & (1 << (tripod - 1))) {
-      goto pop;
-    } else if ((a.score.tripods & prio_mask) != prio_mask && tripod > prio_tripods) {
-      // This is an optimization that works only if there is a solution that obtains
-      // all high-priority tripods. If Optimize() doesn't find a solution, try removing
-      // this branch.
-      goto pop;
+  array<vector<Tripods>, kRows> owned;
+  for (const Item& item : items) {
+    if (item.cost) continue;
+    Tripods x = {};
+    for (uint8_t j = 0; j != kTripods; ++j) {
+      if (item.tripods[j]) x[j] = {item.tripods[j], max<uint8_t>(item.levels[j], 1)};
     }
+    owned[item.row].push_back(x);
+  }
 
-    do {
-      ++a.item;
-      if (a.item == v.size()) goto pop;
-    } while (v[a.item]->used || !book[v[a.item]->row]);
+  // Costs of the cheapest listings for every row and tripods as a max-heap.
+  map<pair<uint8_t, Tripods>, vector<uint16_t>> cheapest;
+  size_t total = 0;
+  string line;
+  for (size_t n = 1; getline(in, line); ++n) {
+    istringstream fields(line);
+    string row, tripod;
+    uint32_t cost;
+    if (!(fields >> row) || row.front() == '#') continue;
+    auto error = [&](const string& msg) {
+      return runtime_error("market line " + to_string(n) + ": " + msg);
+    };
+    if (!rows.count(row)) throw error("unknown row: " + row);
+    if (!(fields >> cost) || cost > numeric_limits<uint16_t>::max()) throw error("invalid cost");
+    Tripods x = {};
+    uint8_t size = 0;
+    for (int i = 0; fields >> tripod; ++i) {
+      if (i == kTripods) throw error("too many tripods");
+      uint8_t level = 1;
+      if (size_t colon = tripod.find(':'); colon != string::npos) {
+        int n = 0;
+        const char* last = tripod.data() + tripod.size();
+        auto [ptr, ec] = from_chars(tripod.data() + colon + 1, last, n);
+        if (ec != errc() || ptr != last || n < 1 || n > kMaxLevel) {
+          throw error("invalid level: " + tripod);
+        }
+        level = n;
+        tripod.resize(colon);
+      }
+      auto it = tripods.find(tripod);
+      if (it == tripods.end()) continue;
+      // A tripod listed twice counts once, with the higher level.
+      auto same =
+          find_if(x.begin(), x.begin() + size, [&](auto a) { return a.first == it->second; });
+      if (same != x.begin() + size) {
+        same->second = max(same->second, level);
+      } else {
+        x[size++] = {it->second, level};
+      }
+    }
+    ++total;
+    if (!size) continue;
+    normalize(x);
+    const vector<Tripods>& o = owned[rows[row]];
+    if (any_of(o.begin(), o.end(), [&](const Tripods& y) { return covers(y, x); })) continue;
+    vector<uint16_t>& heap = cheapest[{rows[row], x}];
+    if (heap.size() == keep && heap.front() <= cost) continue;
+    heap.push_back(cost);
+    push_heap(heap.begin(), heap.end());
+    if (heap.size() > keep) {
+      pop_heap(heap.begin(), heap.end());
+      heap.pop_back();
+    }
+  }
+
+  size_t kept = 0;
+  for (auto& [key, heap] : cheapest) {
+    sort_heap(heap.begin(), heap.end());
+    for (uint16_t cost : heap) {
+      const Tripods& t = key.second;
+      items.push_back({key.first, cost, {t[0].first, t[1].first, t[2].first},
+                       {t[0].second, t[1].second, t[2].second}});
+      ++kept;
+    }
+  }
+  if (log) *log << "Market: kept " << kept << " out of " << total << " listings\n";
+}
+
+// An output buffer that sends everything written to it to a socket. Once the peer is gone, the
+// output gets dropped.
+class SocketBuf : public streambuf {
+ public:
+  explicit SocketBuf(int fd) : fd(fd) { setp(buf, buf + sizeof(buf)); }
+  ~SocketBuf() override { sync(); }
+
+ protected:
+  int overflow(int c) override {
+    sync();
+    if (c != traits_type::eof()) sputc(c);
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    for (char* p = pbase(); p != pptr() && fd >= 0;) {
+      ssize_t n = send(fd, p, pptr() - p, MSG_NOSIGNAL);
+      if (n <= 0) fd = -1;
+      p += max<ssize_t>(n, 0);
+    }
+    setp(buf, buf + sizeof(buf));
+    return 0;
+  }
+
+ private:
+  int fd;
+  char buf[1 << 12];
+};
+
+// Answers requests on a Unix socket at `path` until stop_requested, with `workers` threads.
+// Every connection sends requests, one per line, and gets the output of every request followed
+// by "==[ Done ]==":
+//
+//   solve               The optimal solution. Every new best solution gets sent as soon as it's
+//                       found.
+//   what_if LISTING     The optimal solution with one more item, given in the format of
+//                       ReadMarket().
+//   top K               The K best solutions.
+//
+// Requests of all connections share the workers, and a connection holds a worker only while one
+// of its requests runs. The instance stays in memory between requests, and so does the optimal
+// solution once a request has found it.
+void Serve(const Instance& instance, const vector<Item>& items, const vector<string>& row_names,
+           const vector<string>& tripod_names, const string& path, unsigned workers) {
+  std::mutex mutex;
+  optional<Solution> optimum;
+  auto solve = [&](ostream* log) {
+    {
+      lock_guard lock(mutex);
+      if (optimum) return *optimum;
+    }
+    Solution res = Optimize(instance, {}, {}, log);
+    lock_guard lock(mutex);
+    if (!stop_requested) optimum = res;
+    return res;
+  };
 
-    v[a.item]->used = true;
-    --book[v[a.item]->row];
-    a.score.cost = prev.score.cost + v[a.item]->cost;
-    a.score.tripods = prev.score.tripods;
-    for (uint8_t t : v[a.item]->tripods) {
-      if (t) a.score.tripods |= (uint64_t{1} << (t - 1));
+  auto answer = [&](const string& request, ostream& out) {
+    istringstream fields(request);
+    string command;
+    fields >> command;
+    if (command == "solve") {
+      Print(out, instance, "Best assignment", solve(&out));
+    } else if (command == "what_if") {
+      vector<Item> listing = items;
+      ReadMarket(fields, row_names, tripod_names, instance.classes, 1, listing, nullptr);
+      Solution base = solve(nullptr), res = base;
+      if (listing.size() > items.size()) {
+        Instance local = instance;
+        local.Add(listing.back());
+        res = Optimize(local, base, {local.size() - 1}, &out);
+      }
+      out << "Candidate: " << instance.Format(base.score) << " => " << instance.Format(res.score)
+          << '\n';
+    } else if (command == "top") {
+      size_t k = 0;
+      if (!(fields >> k)) throw runtime_error("top needs the number of solutions");
+      vector<Solution> top = Top(instance, k);
+      for (size_t i = 0; i != top.size(); ++i) {
+        Print(out, instance, "Top #" + to_string(i + 1), top[i]);
+      }
+    } else if (!command.empty()) {
+      throw runtime_error("unknown request: " + command);
     }
+  };
+
+  // A client. Its requests run one at a time, in order.
+  struct Connection {
+    int fd;
+    // What the client has sent past its last request.
+    string input;
+    // Whether a worker is running one of its requests.
+    bool busy = false;
+    // Whether the client has closed its end.
+    bool closed = false;
+  };
+  // The main thread reads the input of idle connections and queues their requests. Workers take
+  // the requests and write a byte to `wake` when they are done, so that the main thread goes on
+  // with the connection.
+  map<int, Connection> connections;
+  deque<pair<Connection*, string>> requests;
+  condition_variable ready;
+  int wake[2];
+  if (pipe(wake)) throw runtime_error("cannot create a pipe");
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) throw runtime_error("cannot create a socket");
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) throw runtime_error("socket path is too long");
+  path.copy(addr.sun_path, path.size());
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+      listen(listener, SOMAXCONN)) {
+    close(listener);
+    throw runtime_error("cannot listen on " + path);
+  }
+  cerr << "Listening on " << path << endl;
+
+  vector<thread> threads(max(1u, workers));
+  for (thread& t : threads) {
+    t = thread([&] {
+      for (;;) {
+        unique_lock lock(mutex);
+        ready.wait(lock, [&] { return !requests.empty() || stop_requested; });
+        if (requests.empty()) return;
+        auto [connection, request] = move(requests.front());
+        requests.pop_front();
+        lock.unlock();
+        {
+          SocketBuf buf(connection->fd);
+          ostream out(&buf);
+          try {
+            answer(request, out);
+          } catch (const exception& e) {
+            out << "error: " << e.what() << '\n';
+          }
+          out << "==[ Done ]==" << endl;
+        }
+        lock.lock();
+        connection->busy = false;
+        // If this fails, the pipe is full and the main thread wakes up anyway.
+        (void)!write(wake[1], "", 1);
+      }
+    });
+  }
 
-    if (assignments.size() != tripods.size()) {
-      assignments.resize(tripods.size(), Assignment{.score = a.score});
-    } else if (a.score.BetterThan(best_score, prio_mask)) {
-      best_score = a.score;
-      cout << "==[ New best assignment: " << a.score.tripod_count(prio_mask) << '/'
-           << a.score.tripod_count() << '/' << a.score.cost << ' ' << bitset<64>(a.score.tripods)
-           << " ]==\n";
-      for (size_t i = 0; i != items.size(); ++i) {
-        if (items[i].used)
-          cout << "Use item: #" << setfill('0') << setw(2) << i << "\n";
+  vector<pollfd> polled;
+  char chunk[1 << 12];
+  while (!stop_requested) {
+    polled = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    {
+      lock_guard lock(mutex);
+      for (auto it = connections.begin(); it != connections.end();) {
+        Connection& c = it->second;
+        if (c.busy) {
+          ++it;
+          continue;
+        }
+        if (size_t eol = c.input.find('\n'); eol != string::npos) {
+          requests.push_back({&c, c.input.substr(0, eol)});
+          c.input.erase(0, eol + 1);
+          c.busy = true;
+          ready.notify_one();
+        } else if (c.closed) {
+          close(c.fd);
+          it = connections.erase(it);
+          continue;
+        } else {
+          polled.push_back({c.fd, POLLIN, 0});
+        }
+        ++it;
+      }
+    }
+    if (poll(polled.data(), polled.size(), 100) <= 0) continue;
+    if (polled[0].revents) {
+      int fd = accept(listener, nullptr, nullptr);
+      lock_guard lock(mutex);
+      if (fd >= 0) connections.insert({fd, {fd}});
+    }
+    if (polled[1].revents) (void)!read(wake[0], chunk, sizeof(chunk));
+    for (size_t k = 2; k != polled.size(); ++k) {
+      if (!polled[k].revents) continue;
+      ssize_t n = read(polled[k].fd, chunk, sizeof(chunk));
+      lock_guard lock(mutex);
+      Connection& c = connections.at(polled[k].fd);
+      if (n <= 0) {
+        c.closed = true;
+      } else {
+        c.input.append(chunk, n);
       }
-      cout << flush;
     }
-    continue;
+  }
+  {
+    lock_guard lock(mutex);
+    requests.clear();
+    ready.notify_all();
+  }
+  for (thread& t : threads) t.join();
+  for (auto& [fd, c] : connections) close(fd);
+  close(wake[0]);
+  close(wake[1]);
+  close(listener);
+  unlink(path.c_str());
+}
 
-  pop:
-    assignments.pop_back();
+// Command line flags.
+struct Options {
+  // --market=FILE: Read items that can be bought from this file. See ReadMarket().
+  string market;
+  // --market_keep=N: Keep this many cheapest market listings with the same row, tripods and
+  // levels.
+  size_t market_keep = 1;
+  // --sweep=N: Instead of the usual output, print the best solution with 0, 1, ..., N more
+  // slots in every row.
+  uint8_t sweep = 0;
+  // --lp_depth=N: Bound search nodes up to this deep with the LP relaxation, -1 to never do it.
+  int lp_depth = 2;
+  // --lagrangian=1: Bound every search node with the Lagrangian relaxation. It's stronger on
+  // large markets but slows down the search of a small library.
+  bool lagrangian = false;
+  // --top_gains=0: Don't bound search nodes with the largest marginal gains of every row. The
+  // bound pays off with more slots or items, but slows down the search of a small library.
+  bool top_gains = true;
+  // --deterministic=N: Search on N threads so that runs with the same N visit the same nodes and
+  // print the same output, and print the number of nodes. See OptimizeInEpochs().
+  unsigned deterministic = 0;
+  // --progress=N: Print an estimate of the size of the search tree, then the progress of the
+  // search every N seconds.
+  int progress = 0;
+  // --checkpoint=FILE: Save the state of the search to this file every --checkpoint_minutes, and
+  // resume the search from it if it exists. The file is removed once the search is over.
+  string checkpoint;
+  int checkpoint_minutes = 10;
+  // --portfolio=1: Race several configurations of the search. See OptimizePortfolio().
+  bool portfolio = false;
+  // --best_first=MB: Expand the most promising nodes first and keep at most this many megabytes
+  // of them. See OptimizeBestFirst().
+  size_t best_first = 0;
+  // --beam=W: Instead of the optimal solution, find a good one fast with a beam of this width.
+  // See BeamSearch().
+  size_t beam = 0;
+  // --discrepancies=K: Look for solutions close to the greedy one first, with up to K
+  // discrepancies from it. See OptimizeWithDiscrepancies().
+  int discrepancies = -1;
+  // --restarts=N: Restart the search with ties broken at random, after N nodes times the Luby
+  // sequence. See OptimizeWithRestarts(). Experimental: it isn't known to beat the usual search
+  // on any instance, and on the one in Main() it takes 12 times as long with N = 100000.
+  uint64_t restarts = 0;
+  // --serve=PATH: Answer requests on a Unix socket at this path until interrupted, with
+  // --workers threads. See Serve().
+  string serve;
+  unsigned workers = max(1u, thread::hardware_concurrency());
+  // --save_instance=FILE: Instead of optimizing, save the instance to this file. See
+  // Instance::Save().
+  string save_instance;
+  // --instance=FILE: Load the instance from this file instead of building it from the items,
+  // the market and the roster in Main().
+  string instance;
+  // --cache=DIR: Look up the optimal solution in this directory before the search, and store it
+  // there after the search. See SolutionCache.
+  string cache;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options res;
+  for (int i = 1; i != argc; ++i) {
+    string_view arg = argv[i];
+    size_t eq = min(arg.find('='), arg.size());
+    string_view name = arg.substr(0, eq);
+    string value(arg.substr(min(eq + 1, arg.size())));
+    if (name == "--market") {
+      res.market = value;
+    } else if (name == "--market_keep") {
+      res.market_keep = stoul(value);
+      if (!res.market_keep) throw runtime_error("--market_keep must be positive");
+    } else if (name == "--sweep") {
+      unsigned long n = stoul(value);
+      if (n > numeric_limits<uint8_t>::max()) throw runtime_error("--sweep is too large");
+      res.sweep = n;
+    } else if (name == "--lp_depth") {
+      res.lp_depth = stoi(value);
+    } else if (name == "--lagrangian") {
+      res.lagrangian = stoi(value);
+    } else if (name == "--top_gains") {
+      res.top_gains = stoi(value);
+    } else if (name == "--cache") {
+      res.cache = value;
+    } else if (name == "--save_instance") {
+      res.save_instance = value;
+    } else if (name == "--instance") {
+      res.instance = value;
+    } else if (name == "--serve") {
+      res.serve = value;
+    } else if (name == "--workers") {
+      res.workers = stoul(value);
+    } else if (name == "--restarts") {
+      res.restarts = stoull(value);
+    } else if (name == "--discrepancies") {
+      res.discrepancies = stoi(value);
+    } else if (name == "--beam") {
+      res.beam = stoul(value);
+    } else if (name == "--best_first") {
+      res.best_first = stoul(value);
+    } else if (name == "--portfolio") {
+      res.portfolio = stoi(value);
+    } else if (name == "--progress") {
+      res.progress = stoi(value);
+    } else if (name == "--deterministic") {
+      res.deterministic = stoul(value);
+    } else if (name == "--checkpoint") {
+      res.checkpoint = value;
+    } else if (name == "--checkpoint_minutes") {
+      res.checkpoint_minutes = stoi(value);
+    } else {
+      throw runtime_error("unknown flag: " + string(arg));
+    }
   }
+  return res;
 }
 
-void Main() {
+void Main(const Options& options) {
   // The book has this many empty slots per row.
   // The first page of my book is already sorted out, so
   // there are 4 empty slots left in each row.
   const Book book = {{4, 4, 4, 4, 4, 4}};
 
-  enum Tripod {
-    // High-priority tripods: prio_tripods in total.
+  NAMED_ENUM(Tripod, tripod_names,
+    // High-priority tripods: tiers[0] in total.
     kPunishingStrike_MindEnhancement = 1,
     kFrostsCall_EnhancedStrike,
     kPunishingStrike_UnavoidableFate,
@@ -194,15 +3503,24 @@ void Main() {
     kIceShower_FrostZone,
     kReverseGravity_WeakPointDetection,
     kSeraphicHail_WeakPointDetection,
-  };
+  );
 
-  // This many first tripods listed in Tripod enum are high-priority.
-  const int prio_tripods = 20;
+  // Tripods listed in Tripod enum are split into priority tiers of these sizes, the top one
+  // first. The remaining tripods form the last tier. The default makes the first 20 tripods
+  // high-priority and the rest low-priority.
+  const vector<uint8_t> tiers = {20};
 
-  enum Row { kHelmet, kShoulders, kChest, kPants, kGloves, kWeapon };
+  // Tripods that count more than once within their tier, with their weights. For example,
+  // {kInferno_FlameArea, 3} makes this tripod worth three others of its tier.
+  const vector<pair<uint8_t, int>> weights = {
+  };
+
+  NAMED_ENUM(Row, row_names, kHelmet, kShoulders, kChest, kPants, kGloves, kWeapon);
 
   // Items that you either have or can buy. Set cost to non-zero for items that
-  // you can buy and to zero for those that you own.
+  // you can buy and to zero for those that you own. Tripod levels, if you care
+  // about them, go after tripods: {kPants, 0, {kInferno_Ignite, kSqual_QuickPrep}, {5, 2}}.
+  // Tripods without levels are level 1.
   vector<Item> items = {
       /* 00 01:01 */ {kWeapon, 0, {kLightningVortex_QuickPace}},
       /* 01 01:02 */ {kWeapon, 0, {kRimeArrow_FrostBarrage}},
@@ -288,9 +3606,131 @@ void Main() {
       /* 74 10:08 */ {kShoulders, 0, {kInferno_FirepowerSupplement}},
   };
 
-  Optimize(items, prio_tripods, book);
+  // Items that you consider buying. For each of them the program reports the best score you
+  // would get if you added it to the items above.
+  vector<Item> candidates = {
+  };
+
+  // To optimize the library for several classes of your roster at once, list them here: the
+  // tripods of every class (high-priority first, just like in Tripod), their tiers and weights
+  // and how much the class matters compared to the others. For example:
+  //
+  //   {.tripods = {kInferno_FlameArea, kDoomsday_Insight, kSqual_QuickPrep}, .tiers = {1}},
+  //   {.tripods = {kIceShower_FrostZone, kDoomsday_Insight}, .tiers = {2}, .weight = 2},
+  //
+  // If the list is empty, the library is optimized for all tripods in Tripod with the tiers
+  // and weights given above.
+  vector<Class> roster = {
+  };
+
+  if (roster.empty()) {
+    Class& cls = roster.emplace_back(Class{.tiers = tiers, .weights = weights});
+    for (size_t t = 1; t != tripod_names.size(); ++t) cls.tripods.push_back(t);
+  }
+
+  if (!options.market.empty() && options.instance.empty()) {
+    ifstream market(options.market);
+    if (!market) throw runtime_error("cannot open " + options.market);
+    ReadMarket(market, row_names, tripod_names, roster, options.market_keep, items);
+  }
+
+  // The library as it is now, if you want the program to tell you how to rearrange it. List the
+  // pages that the program may rearrange, how many slots every row of a page has and the items
+  // that are in these pages now as {item, page, slot}. For example:
+  //
+  //   {.first_page = 2, .pages = 2, .slots = 4, .placed = {{9, 2, 1}, {54, 3, 4}}}
+  //
+  // If pages isn't zero, book is ignored: every row has pages * slots slots.
+  const Layout layout = {};
+
+  Book capacity = book;
+  vector<uint32_t> placed;
+  if (layout.pages) {
+    if (layout.pages * layout.slots > numeric_limits<uint8_t>::max()) {
+      throw runtime_error("too many slots in a row");
+    }
+    capacity.fill(layout.pages * layout.slots);
+    for (const Layout::Placement& p : layout.placed) placed.push_back(p.item);
+  }
+
+  Instance instance = options.instance.empty() ? Instance(items, roster, capacity, placed)
+                                               : Instance::Load(options.instance, items);
+  // Moves count even if the library is empty now: every stored item has to be put in.
+  if (layout.pages) instance.track_moves = true;
+  if (!options.save_instance.empty()) return instance.Save(options.save_instance, items);
+  instance.lp_depth = options.lp_depth;
+  instance.lagrangian = options.lagrangian;
+  instance.top_gains = options.top_gains;
+  instance.progress = options.progress;
+  if (!options.serve.empty()) {
+    return Serve(instance, items, row_names, tripod_names, options.serve, options.workers);
+  }
+  if (options.sweep) {
+    vector<Solution> curve = Sweep(instance, options.sweep);
+    for (size_t e = 0; e != curve.size(); ++e) {
+      Print(cout, instance, (stop_requested ? "Stopped, capacity +" : "Capacity +") + to_string(e),
+            curve[e]);
+    }
+    return;
+  }
+  Solution base;
+  const SolutionCache cache{options.cache};
+  optional<Solution> cached;
+  if (!cache.dir.empty() && (cached = cache.Find(instance))) {
+    base = *cached;
+    Print(cout, instance, "Cached assignment", base);
+  } else if (options.deterministic) {
+    base = OptimizeInEpochs(instance, options.deterministic);
+  } else if (options.portfolio) {
+    base = OptimizePortfolio(instance);
+  } else if (options.restarts) {
+    base = OptimizeWithRestarts(instance, options.restarts);
+  } else if (options.discrepancies >= 0) {
+    base = OptimizeWithDiscrepancies(instance, options.discrepancies);
+  } else if (options.beam) {
+    base = BeamSearch(instance, options.beam);
+  } else if (options.best_first) {
+    base = OptimizeBestFirst(instance, options.best_first << 20);
+  } else if (!options.checkpoint.empty()) {
+    Search search(instance, instance.book, {});
+    base = Optimize(search, {}, &cout, options.checkpoint,
+                    chrono::minutes(options.checkpoint_minutes));
+  } else {
+    base = OptimizeParts(instance, items);
+  }
+  if (stop_requested) return;
+  // All searches but the beam search prove their solution optimal.
+  if (!cache.dir.empty() && !cached && !options.beam) cache.Store(instance, base);
+  if (layout.pages) {
+    vector<Move> moves = PlanMoves(layout, instance, base);
+    cout << "==[ Moves: " << moves.size() << " ]==\n";
+    for (const Move& m : moves) {
+      cout << (m.put_in ? "Put item #" : "Take out item #") << setfill('0') << setw(2) << m.item
+           << (m.put_in ? " into " : " from ") << row_names[instance.rows[m.item]] << ' '
+           << setw(2) << int{m.page} << ':' << setw(2) << int{m.slot} << '\n';
+    }
+  }
+  if (candidates.empty()) return;
+
+  vector<Solution> what_if = WhatIf(instance, base, candidates);
+  if (stop_requested) return;
+  for (size_t i = 0; i != candidates.size(); ++i) {
+    cout << "Candidate #" << setfill('0') << setw(2) << i << ": " << instance.Format(base.score)
+         << " => " << instance.Format(what_if[i].score) << '\n';
+  }
 }
 
 }  // namespace
 
-int main(int argc, char** argv) { Main(); }
+// check.cc includes this file for its own main().
+#ifndef LA_TRIPODS_NO_MAIN
+int main(int argc, char** argv) {
+  for (int sig : {SIGINT, SIGTERM, SIGUSR1}) signal(sig, OnSignal);
+  try {
+    Main(ParseOptions(argc, argv));
+  } catch (const exception& e) {
+    cerr << "error: " << e.what() << endl;
+    return 1;
+  }
+}
+#endif